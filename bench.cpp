@@ -0,0 +1,229 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+// Interpreter throughput benchmark.
+//
+// Every script is compiled as stack code and as register code, and each is run once with
+// instruction counting (CL_FEATURE_COUNT) enabled, then 'repeat' times (first argument, default 3)
+// at full speed without any optional interpreter features, reporting the best time. Build it once
+// with the default (threaded) dispatch and once with -DCL_NO_THREADED_DISPATCH to compare both
+// interpreter loops. The numeric scripts (loop, while, call, float, nbody) cover the integer/float
+// fast paths of the arithmetic and comparison instructions, the switch script the jump tables of
+// switch statements.
+
+#include "cl2.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <ctime>
+
+using namespace std;
+
+struct Benchmark
+{
+	const char *name;
+	const char *source;
+};
+
+static Benchmark benchmarks[] =
+{
+	{
+		"loop",
+		"local i, j, sum = 0;"
+		"for (i = 0; i < 1000; i = i + 1)"
+		"{"
+		"	for (j = 0; j < 1000; j = j + 1)"
+		"	{"
+		"		sum = sum + (i * j) % 7 - j;"
+		"	}"
+		"}"
+	},
+	{
+		"while",
+		"local n = 0, acc = 0;"
+		"while (n < 1000000)"
+		"{"
+		"	if (n & 1) acc = acc + n; else acc = acc - 1;"
+		"	n = n + 1;"
+		"}"
+	},
+	{
+		"call",
+		"function fib(n) { if (n < 2) return(n); return(fib(n - 1) + fib(n - 2)); }"
+		"fib(27);"
+	},
+	{
+		"method",
+		"local obj = [count = 0, function inc(d) { self.count = self.count + d; return(self.count); }];"
+		"local i;"
+		"for (i = 0; i < 500000; i = i + 1) obj.inc(1);"
+	},
+	{
+		"float",
+		"local i, x = 0.0, y = 1.0, z = 0.5;"
+		"for (i = 0; i < 500000; i = i + 1)"
+		"{"
+		"	x = x + y * z;"
+		"	y = y * 0.999999 - z / 1000000.0;"
+		"	if (x > 1000.0) x = x - 1000.0;"
+		"}"
+	},
+	{
+		"nbody",
+		"local bodies = array["
+		"	[x = 0.0, y = 0.0, z = 0.0, vx = 0.0, vy = 0.0, vz = 0.0, m = 39.47],"
+		"	[x = 4.84, y = -1.16, z = -0.1, vx = 0.6, vy = 2.81, vz = -0.02, m = 0.037],"
+		"	[x = 8.34, y = 4.12, z = -0.4, vx = -1.01, vy = 1.82, vz = 0.008, m = 0.011],"
+		"	[x = 12.89, y = -15.11, z = -0.22, vx = 1.08, vy = 0.86, vz = -0.01, m = 0.0017],"
+		"	[x = 15.37, y = -25.91, z = 0.17, vx = 0.97, vy = 0.59, vz = -0.03, m = 0.002]];"
+		"local sqrt = math.sqrt, dt = 0.01, n = 5, step, i, j;"
+		"for (step = 0; step < 5000; step = step + 1)"
+		"{"
+		"	for (i = 0; i < n; i = i + 1)"
+		"	{"
+		"		local a = bodies[i];"
+		"		for (j = i + 1; j < n; j = j + 1)"
+		"		{"
+		"			local b = bodies[j];"
+		"			local dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;"
+		"			local d2 = dx * dx + dy * dy + dz * dz;"
+		"			local mag = dt / (d2 * sqrt(d2));"
+		"			a.vx = a.vx - dx * b.m * mag; a.vy = a.vy - dy * b.m * mag; a.vz = a.vz - dz * b.m * mag;"
+		"			b.vx = b.vx + dx * a.m * mag; b.vy = b.vy + dy * a.m * mag; b.vz = b.vz + dz * a.m * mag;"
+		"		}"
+		"	}"
+		"	for (i = 0; i < n; i = i + 1)"
+		"	{"
+		"		local a = bodies[i];"
+		"		a.x = a.x + dt * a.vx; a.y = a.y + dt * a.vy; a.z = a.z + dt * a.vz;"
+		"	}"
+		"}"
+	},
+	{
+		"switch",
+		"local msgs = array[\"move\", \"stop\", \"jump\", \"fire\", \"wait\", \"turn\", \"load\", \"save\"];"
+		"local i, acc = 0;"
+		"for (i = 0; i < 300000; i = i + 1)"
+		"{"
+		"	switch (i % 16)"
+		"	{"
+		"		case (0) acc = acc + 1;   case (1) acc = acc + 2;   case (2) acc = acc + 3;   case (3) acc = acc + 4;"
+		"		case (4) acc = acc + 5;   case (5) acc = acc + 6;   case (6) acc = acc + 7;   case (7) acc = acc + 8;"
+		"		case (8) acc = acc - 1;   case (9) acc = acc - 2;   case (10) acc = acc - 3;  case (11) acc = acc - 4;"
+		"		case (12) acc = acc - 5;  case (13) acc = acc - 6;  case (14) acc = acc - 7;  else acc = acc - 8;"
+		"	}"
+		"	switch (msgs[i % 8])"
+		"	{"
+		"		case (\"move\") acc = acc + 1; case (\"stop\") acc = acc + 2; case (\"jump\") acc = acc + 3;"
+		"		case (\"fire\") acc = acc + 4; case (\"wait\") acc = acc + 5; case (\"turn\") acc = acc + 6;"
+		"		case (\"load\") acc = acc + 7; case (\"save\") acc = acc + 8;"
+		"	}"
+		"}"
+	},
+};
+static const int num_benchmarks = sizeof(benchmarks) / sizeof(Benchmark);
+
+static CLValue compileBenchmark(const Benchmark &bench, CLCodeType code_type)
+{
+	std::istringstream input(bench.source);
+	return CLCompiler::compile(input, code_type);
+}
+
+// run the script and return the number of executed instructions
+static unsigned long countInstructions(CLContext &context, CLValue mainfunc)
+{
+	CLValue thr(new CLThread());
+	GET_THREAD(thr)->init(mainfunc);
+	GET_THREAD(thr)->setFeatures(CL_FEATURE_COUNT);
+	while (GET_THREAD(thr)->isRunning()) GET_THREAD(thr)->run();
+
+	return GET_THREAD(thr)->getInstructionCount();
+}
+
+// run the script without timeout, and return the used time in seconds
+static double measureTime(CLContext &context, CLValue mainfunc)
+{
+	CLValue thr(new CLThread());
+	GET_THREAD(thr)->init(mainfunc);
+	GET_THREAD(thr)->setFeatures(0);
+
+	clock_t start = clock();
+	while (GET_THREAD(thr)->isRunning()) GET_THREAD(thr)->run();
+	clock_t end = clock();
+
+	return double(end - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **args)
+{
+	int repeat = argc > 1 ? atoi(args[1]) : 3;
+	if (repeat < 1) repeat = 1;
+
+	try
+	{
+		CLContext context;
+		CLMathModule math;
+		context.addModule(&math);
+
+#ifdef CL_THREADED_DISPATCH
+		cout << "Dispatch: threaded (computed goto)" << endl;
+#else
+		cout << "Dispatch: switch" << endl;
+#endif
+		cout << setw(10) << left << "script" << setw(10) << "code" << setw(14) << right << "instructions" 
+		     << setw(12) << "seconds" << setw(16) << "instr/sec" << endl;
+
+		for (int i=0; i<num_benchmarks; ++i)
+		{
+			for (int c=0; c<2; ++c)
+			{
+				CLCodeType code_type = c == 0 ? CL_STACK_CODE : CL_REGISTER_CODE;
+				CLValue mainfunc = compileBenchmark(benchmarks[i], code_type);
+				context.addRoot(mainfunc);
+				unsigned long count = countInstructions(context, mainfunc);
+
+				// take the best of 'repeat' runs
+				double best = -1.0;
+				for (int r=0; r<repeat; ++r)
+				{
+					double t = measureTime(context, mainfunc);
+					if (best < 0.0 || t < best) best = t;
+				}
+
+				cout << setw(10) << left << benchmarks[i].name << setw(10) << (c == 0 ? "stack" : "register")
+				     << setw(14) << right << count 
+				     << setw(12) << fixed << setprecision(3) << best
+				     << setw(16) << setprecision(0) << (best > 0.0 ? count / best : 0.0) << endl;
+
+				context.removeRoot(mainfunc);
+				context.collectGarbage();
+			}
+		}
+
+		context.clear();
+
+	} catch (CLParserException err) {
+		cout << err.what() << endl;
+	} catch (std::runtime_error err) {
+		cout << err.what() << endl;
+	}
+}
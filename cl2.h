@@ -25,6 +25,8 @@
 #include "compiler/clifunction.h"
 #include "compiler/cliinstruction.h"
 #include "compiler/cllexer.h"
+#include "compiler/clpeephole.h"
+#include "compiler/clregtranslator.h"
 #include "serialize/clserializer.h"
 #include "serialize/clserialloader.h"
 #include "serialize/clserialsaver.h"
@@ -40,8 +42,10 @@
 #include "vm/clcontext.h"
 #include "vm/clmathmodule.h"
 #include "vm/clmodule.h"
+#include "vm/clpool.h"
 #include "vm/clsysmodule.h"
 #include "vm/clthread.h"
+#include "vm/clverifier.h"
 #include "vm/clcollectable.h"
 #include "clopcode.h"
 
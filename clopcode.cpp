@@ -25,79 +25,150 @@
 
 static CLOpcodeDesc opdesc[] =
 {
-	{OP_NOP, "nop", ARG_NONE},
+	{OP_NOP, "nop", ARG_NONE, false},
 
-	{OP_PUSH0, "push0", ARG_NONE},
-	{OP_PUSHROOT, "pushroot", ARG_NONE},
-	{OP_PUSHSELF, "pushself", ARG_NONE},
-	{OP_PUSHCONST, "pushconst", ARG_INTEGER},
-	{OP_PUSHEXTFUNC, "pushextfunc", ARG_STRING},
-	{OP_PUSHI, "pushi", ARG_INTEGER},
-	{OP_PUSHF, "pushf", ARG_FLOAT},
-	{OP_PUSHS, "pushs", ARG_STRING},
-	{OP_POP, "pop", ARG_INTEGER},
+	{OP_PUSH0, "push0", ARG_NONE, false},
+	{OP_PUSHROOT, "pushroot", ARG_NONE, false},
+	{OP_PUSHSELF, "pushself", ARG_NONE, false},
+	{OP_PUSHCONST, "pushconst", ARG_INTEGER, false},
+	{OP_PUSHI, "pushi", ARG_INTEGER, false},
+	{OP_PUSHF, "pushf", ARG_FLOAT, false},
+	{OP_POP, "pop", ARG_INTEGER, false},
 
-	{OP_DUP, "dup", ARG_INTEGER},
+	{OP_DUP, "dup", ARG_INTEGER, false},
 
 	// tables
-	{OP_TABGET, "tabget", ARG_NONE},
-	{OP_TABGET2, "tabget2", ARG_NONE},
-	{OP_TABSET, "tabset", ARG_NONE},
-	{OP_NEWTABLE, "newtable", ARG_NONE},
-	{OP_NEWARRAY, "newarray", ARG_NONE},
+	{OP_TABGET, "tabget", ARG_NONE, false},
+	{OP_TABGET2, "tabget2", ARG_NONE, false},
+	{OP_TABSET, "tabset", ARG_NONE, false},
+	{OP_NEWTABLE, "newtable", ARG_NONE, false},
+	{OP_NEWARRAY, "newarray", ARG_NONE, false},
 
-	{OP_TABIT, "tabit", ARG_NONE},
-	{OP_TABNEXT, "tabnext", ARG_NONE},
+	{OP_TABIT, "tabit", ARG_NONE, false},
+	{OP_TABNEXT, "tabnext", ARG_NONE, false},
 
-	{OP_CLONE, "clone", ARG_NONE},
+	{OP_CLONE, "clone", ARG_NONE, false},
+
+	// global variables
+	{OP_GETGLOBAL, "getglobal", ARG_INTEGER, false},
+	{OP_SETGLOBAL, "setglobal", ARG_INTEGER, false},
 
 	// local variables..
-	{OP_PUSHL, "pushl", ARG_INTEGER},
-	{OP_POPL, "popl", ARG_INTEGER},
-	{OP_ADDL, "addl", ARG_INTEGER},
-	{OP_DELL, "dell", ARG_INTEGER},
+	{OP_PUSHL, "pushl", ARG_INTEGER, false},
+	{OP_POPL, "popl", ARG_INTEGER, false},
+	{OP_CLEARL, "clearl", ARG_INTEGER, false},
 
 	// arithmetic
-	{OP_ADD, "add", ARG_NONE},
-	{OP_SUB, "sub", ARG_NONE},
-	{OP_MUL, "mul", ARG_NONE},
-	{OP_DIV, "div", ARG_NONE},
-	{OP_MODULO, "modulo", ARG_NONE},
-	{OP_NEG, "neg", ARG_NONE},
+	{OP_ADD, "add", ARG_NONE, false},
+	{OP_SUB, "sub", ARG_NONE, false},
+	{OP_MUL, "mul", ARG_NONE, false},
+	{OP_DIV, "div", ARG_NONE, false},
+	{OP_MODULO, "modulo", ARG_NONE, false},
+	{OP_NEG, "neg", ARG_NONE, false},
 
 	// bitwise
-	{OP_BITOR, "bitor", ARG_NONE},
-	{OP_BITAND, "bitand", ARG_NONE},
-	{OP_BITXOR, "bitxor", ARG_NONE},
-	{OP_SHL, "shl", ARG_NONE},
-	{OP_SHR, "shr", ARG_NONE},
+	{OP_BITOR, "bitor", ARG_NONE, false},
+	{OP_BITAND, "bitand", ARG_NONE, false},
+	{OP_BITXOR, "bitxor", ARG_NONE, false},
+	{OP_SHL, "shl", ARG_NONE, false},
+	{OP_SHR, "shr", ARG_NONE, false},
 
 	// logical
-	{OP_OR, "or", ARG_NONE},
-	{OP_AND, "and", ARG_NONE},
-	{OP_NOT, "not", ARG_NONE},
+	{OP_OR, "or", ARG_NONE, false},
+	{OP_AND, "and", ARG_NONE, false},
+	{OP_NOT, "not", ARG_NONE, false},
 
 	// comparison
-	{OP_EQ, "eq", ARG_NONE},
-	{OP_NEQ, "neq", ARG_NONE},
-	{OP_LT, "lt", ARG_NONE},
-	{OP_GT, "gt", ARG_NONE},
-	{OP_LE, "le", ARG_NONE},
-	{OP_GE, "ge", ARG_NONE},
+	{OP_EQ, "eq", ARG_NONE, false},
+	{OP_NEQ, "neq", ARG_NONE, false},
+	{OP_LT, "lt", ARG_NONE, false},
+	{OP_GT, "gt", ARG_NONE, false},
+	{OP_LE, "le", ARG_NONE, false},
+	{OP_GE, "ge", ARG_NONE, false},
 
 	// function call; return
-	{OP_MCALL, "mcall", ARG_NONE},
-	{OP_RET, "ret", ARG_NONE},
-	{OP_YIELD, "yield", ARG_NONE},
+	{OP_MCALL, "mcall", ARG_NONE, false},
+	{OP_RET, "ret", ARG_NONE, false},
+	{OP_YIELD, "yield", ARG_NONE, false},
+	{OP_TAILCALL, "tailcall", ARG_NONE, false},
 
 	// execution control
-	{OP_JMP, "jmp", ARG_INTEGER},
-	{OP_JMPT, "jmpt", ARG_INTEGER},
-	{OP_JMPF, "jmpf", ARG_INTEGER},
-
-	// debug
-	{OP_FILE, "file", ARG_STRING},
-	{OP_LINE, "line", ARG_INTEGER}
+	{OP_JMP, "jmp", ARG_INTEGER, false},
+	{OP_JMPT, "jmpt", ARG_INTEGER, false},
+	{OP_JMPF, "jmpf", ARG_INTEGER, false},
+
+	// compare and branch
+	{OP_EQJMPF, "eqjmpf", ARG_INTEGER, false},
+	{OP_NEQJMPF, "neqjmpf", ARG_INTEGER, false},
+	{OP_LTJMPF, "ltjmpf", ARG_INTEGER, false},
+	{OP_GTJMPF, "gtjmpf", ARG_INTEGER, false},
+	{OP_LEJMPF, "lejmpf", ARG_INTEGER, false},
+	{OP_GEJMPF, "gejmpf", ARG_INTEGER, false},
+	{OP_SWITCH, "switch", ARG_INTEGER, false},
+
+	// superinstructions
+	{OP_ADDLK, "addlk", ARG_NONE, true},
+	{OP_LTLKJMPF, "ltlkjmpf", ARG_INTEGER, true},
+	{OP_TABPUT, "tabput", ARG_NONE, false},
+
+	// register code
+	{OP_RMOVE, "rmove", ARG_NONE, true},
+	{OP_RSELF, "rself", ARG_NONE, true},
+	{OP_RROOT, "rroot", ARG_NONE, true},
+	{OP_RNEWTABLE, "rnewtable", ARG_NONE, true},
+	{OP_RNEWARRAY, "rnewarray", ARG_NONE, true},
+
+	{OP_RTABGET, "rtabget", ARG_INTEGER, true},
+	{OP_RTABGET2, "rtabget2", ARG_INTEGER, true},
+	{OP_RTABSET, "rtabset", ARG_INTEGER, true},
+	{OP_RTABIT, "rtabit", ARG_NONE, true},
+	{OP_RTABNEXT, "rtabnext", ARG_NONE, true},
+	{OP_RCLONE, "rclone", ARG_NONE, true},
+
+	{OP_RGETGLOBAL, "rgetglobal", ARG_INTEGER, true},
+	{OP_RSETGLOBAL, "rsetglobal", ARG_INTEGER, true},
+
+	{OP_RADD, "radd", ARG_INTEGER, true},
+	{OP_RSUB, "rsub", ARG_INTEGER, true},
+	{OP_RMUL, "rmul", ARG_INTEGER, true},
+	{OP_RDIV, "rdiv", ARG_INTEGER, true},
+	{OP_RMODULO, "rmodulo", ARG_INTEGER, true},
+	{OP_RNEG, "rneg", ARG_NONE, true},
+
+	{OP_RBITOR, "rbitor", ARG_INTEGER, true},
+	{OP_RBITAND, "rbitand", ARG_INTEGER, true},
+	{OP_RBITXOR, "rbitxor", ARG_INTEGER, true},
+	{OP_RSHL, "rshl", ARG_INTEGER, true},
+	{OP_RSHR, "rshr", ARG_INTEGER, true},
+
+	{OP_RAND, "rand", ARG_INTEGER, true},
+	{OP_ROR, "ror", ARG_INTEGER, true},
+	{OP_RNOT, "rnot", ARG_NONE, true},
+
+	{OP_REQ, "req", ARG_INTEGER, true},
+	{OP_RNEQ, "rneq", ARG_INTEGER, true},
+	{OP_RLT, "rlt", ARG_INTEGER, true},
+	{OP_RGT, "rgt", ARG_INTEGER, true},
+	{OP_RLE, "rle", ARG_INTEGER, true},
+	{OP_RGE, "rge", ARG_INTEGER, true},
+
+	{OP_RCALL, "rcall", ARG_INTEGER, true},
+	{OP_RRET, "rret", ARG_NONE, true},
+	{OP_RYIELD, "ryield", ARG_NONE, true},
+	{OP_RTAILCALL, "rtailcall", ARG_INTEGER, true},
+	{OP_RJMPT, "rjmpt", ARG_INTEGER, true},
+	{OP_RJMPF, "rjmpf", ARG_INTEGER, true},
+
+	{OP_REQJMPF, "reqjmpf", ARG_INTEGER, true},
+	{OP_RNEQJMPF, "rneqjmpf", ARG_INTEGER, true},
+	{OP_RLTJMPF, "rltjmpf", ARG_INTEGER, true},
+	{OP_RGTJMPF, "rgtjmpf", ARG_INTEGER, true},
+	{OP_RLEJMPF, "rlejmpf", ARG_INTEGER, true},
+	{OP_RGEJMPF, "rgejmpf", ARG_INTEGER, true},
+	{OP_RSWITCH, "rswitch", ARG_INTEGER, true},
+
+	// pseudo instructions
+	{OP_LINE, "line", ARG_INTEGER, false},
 };
 static const int num_opdesc = sizeof(opdesc) / sizeof(CLOpcodeDesc);
 
@@ -32,10 +32,8 @@ enum CLOpcode
 	OP_PUSHSELF,    //                        | self context                 |
 	OP_PUSHROOT,    //                        | root table                   |
 	OP_PUSHCONST,   //                        | constant value               | <i> constant id#
-	OP_PUSHEXTFUNC, //                        | external_function value      | <s> identification string
 	OP_PUSHI,       //                        | integer value                | <i> value to push
 	OP_PUSHF,       //                        | float value                  | <f> value to push
-	OP_PUSHS,       //                        | string value                 | <s> value to push
 	OP_POP,	        //                        |                              | <i> number of items to pop
 
 	OP_DUP,         //                        |                              | <i> (positive) offset of value to dup (0 = stack top)
@@ -52,11 +50,14 @@ enum CLOpcode
 
 	OP_CLONE,       // object                 | cloned_object                |
 
-	// local variable creation/removal
+	// global variables (root table slots)
+	OP_GETGLOBAL,   //                        | global variable value        | <i> constant id# of name
+	OP_SETGLOBAL,   // new value              |                              | <i> constant id# of name
+
+	// local variables (the frame holds all locals of the function, see CLFunction::frame_size)
 	OP_PUSHL,       //                        | local variable contents      | <i> local var #
 	OP_POPL,        // new value              |                              | <i> local var #
-	OP_ADDL,        //                        |                              | <i> number of locals to add
-	OP_DELL,        //                        |                              | <i> number of locals to remove
+	OP_CLEARL,      //                        |                              | <i> first local var # to set to null (up to the frame end)
 	
 	// arithmetic
 	OP_ADD,		// 2 Operands             | 1: Result
@@ -89,21 +90,111 @@ enum CLOpcode
 	OP_MCALL,       //func,self,arg[1..n],argc| function result              |
 	OP_RET,         // function result        |                              |                       
 	OP_YIELD,       // yield result           |                              | 
+	OP_TAILCALL,    //func,self,arg[1..n],argc| (returns the function result)| reuses the caller's frame
 
 	OP_JMP,	        //                        |                              | <i> new instruction pointer
 	OP_JMPT,        // condition              |                              | <i> new instruction pointer (if condition is true)
 	OP_JMPF,        // condition              |                              | <i> new instruction pointer (if condition is false)
 
-	OP_FILE,        //                        |                              | <s> file name
-	OP_LINE,        //                        |                              | <i> line number
+	// compare and branch (conditions of if/while/for/switch)
+	OP_EQJMPF,      // 2 Operands             |                              | <i> new instruction pointer (if not operand1 == operand2)
+	OP_NEQJMPF,     // 2 Operands             |                              | <i> new instruction pointer (if not operand1 != operand2)
+	OP_LTJMPF,      // 2 Operands             |                              | <i> new instruction pointer (if not operand1 < operand2)
+	OP_GTJMPF,      // 2 Operands             |                              | <i> new instruction pointer (if not operand1 > operand2)
+	OP_LEJMPF,      // 2 Operands             |                              | <i> new instruction pointer (if not operand1 <= operand2)
+	OP_GEJMPF,      // 2 Operands             |                              | <i> new instruction pointer (if not operand1 >= operand2)
+	OP_SWITCH,      // (value, stays on stack)|                              | <i> jump table # (CLFunction::switches)
+
+	// superinstructions (fused by CLPeephole). LK[x] is local #x or, for x >= CL_RK_CONSTANT, constant #x-CL_RK_CONSTANT
+	OP_ADDLK,       //                        | local a + LK[b]              | (a: local #, b: local/constant)
+	OP_LTLKJMPF,    //                        |                              | <i> new instruction pointer (if not local a < LK[b])
+	OP_TABPUT,      // table,key,value        |                              |
+
+	// register code (see CLCodeType): operands are registers R[x] (the frame's locals) or, where noted as
+	// RK[x], registers or constants (x >= CL_RK_CONSTANT: constant #x-CL_RK_CONSTANT)
+	//
+	//                 Operation                                             | a     | b     | arg
+	// --------------------------------------------------------------------------------------------------
+	OP_RMOVE,       // R[a] = RK[b]                                          | <r>   | <rk>  |
+	OP_RSELF,       // R[a] = self context                                   | <r>   |       |
+	OP_RROOT,       // R[a] = root table                                     | <r>   |       |
+	OP_RNEWTABLE,   // R[a] = new table                                      | <r>   |       |
+	OP_RNEWARRAY,   // R[a] = new array                                      | <r>   |       |
+
+	OP_RTABGET,     // R[a] = RK[b][RK[arg]]                                 | <r>   | <rk>  | <rk>
+	OP_RTABGET2,    // R[a] = RK[b][RK[arg]], R[a+1] = RK[b]                 | <r>   | <rk>  | <rk>
+	OP_RTABSET,     // R[a][RK[b]] = RK[arg]                                 | <r>   | <rk>  | <rk>
+	OP_RTABIT,      // R[a+1] = iterator of R[a]                             | <r>   |       |
+	OP_RTABNEXT,    // R[a+1] = ++R[a+1], R[a+2] = value, R[a+3] = key       | <r>   |       |
+	OP_RCLONE,      // R[a] = clone RK[b]                                    | <r>   | <rk>  |
+
+	OP_RGETGLOBAL,  // R[a] = global variable                                | <r>   |       | <i> constant id# of name
+	OP_RSETGLOBAL,  // global variable = RK[b]                               |       | <rk>  | <i> constant id# of name
+
+	OP_RADD,        // R[a] = RK[b] + RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RSUB,        // R[a] = RK[b] - RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RMUL,        // R[a] = RK[b] * RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RDIV,        // R[a] = RK[b] / RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RMODULO,     // R[a] = RK[b] % RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RNEG,        // R[a] = -RK[b]                                         | <r>   | <rk>  |
+
+	OP_RBITOR,      // R[a] = RK[b] | RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RBITAND,     // R[a] = RK[b] & RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RBITXOR,     // R[a] = RK[b] ^ RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RSHL,        // R[a] = RK[b] << RK[arg]                               | <r>   | <rk>  | <rk>
+	OP_RSHR,        // R[a] = RK[b] >> RK[arg]                               | <r>   | <rk>  | <rk>
+
+	OP_RAND,        // R[a] = RK[b] and RK[arg]                              | <r>   | <rk>  | <rk>
+	OP_ROR,         // R[a] = RK[b] or RK[arg]                               | <r>   | <rk>  | <rk>
+	OP_RNOT,        // R[a] = not RK[b]                                      | <r>   | <rk>  |
+
+	OP_REQ,         // R[a] = RK[b] == RK[arg]                               | <r>   | <rk>  | <rk>
+	OP_RNEQ,        // R[a] = RK[b] != RK[arg]                               | <r>   | <rk>  | <rk>
+	OP_RLT,         // R[a] = RK[b] < RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RGT,         // R[a] = RK[b] > RK[arg]                                | <r>   | <rk>  | <rk>
+	OP_RLE,         // R[a] = RK[b] <= RK[arg]                               | <r>   | <rk>  | <rk>
+	OP_RGE,         // R[a] = RK[b] >= RK[arg]                               | <r>   | <rk>  | <rk>
+
+	OP_RCALL,       // R[a] = R[a](self=R[a+1], args=R[a+2..a+1+arg])       | <r>   |       | <i> argc
+	OP_RRET,        // return RK[b]                                          |       | <rk>  |
+	OP_RYIELD,      // yield RK[b]                                           |       | <rk>  |
+	OP_RTAILCALL,   // return R[a](self=R[a+1], args=R[a+2..a+1+arg])        | <r>   |       | <i> argc
+	OP_RJMPT,       // jump to arg if RK[b] is true                          |       | <rk>  | <i> new instruction pointer
+	OP_RJMPF,       // jump to arg if RK[b] is false                         |       | <rk>  | <i> new instruction pointer
+
+	OP_REQJMPF,     // jump to arg if not R[a] == RK[b]                      | <r>   | <rk>  | <i> new instruction pointer
+	OP_RNEQJMPF,    // jump to arg if not R[a] != RK[b]                      | <r>   | <rk>  | <i> new instruction pointer
+	OP_RLTJMPF,     // jump to arg if not R[a] < RK[b]                       | <r>   | <rk>  | <i> new instruction pointer
+	OP_RGTJMPF,     // jump to arg if not R[a] > RK[b]                       | <r>   | <rk>  | <i> new instruction pointer
+	OP_RLEJMPF,     // jump to arg if not R[a] <= RK[b]                      | <r>   | <rk>  | <i> new instruction pointer
+	OP_RGEJMPF,     // jump to arg if not R[a] >= RK[b]                      | <r>   | <rk>  | <i> new instruction pointer
+	OP_RSWITCH,     // jump to the target of RK[b] in jump table #arg        |       | <rk>  | <i> jump table # (CLFunction::switches)
+
+	NUM_OPCODES,    // number of opcodes (not an opcode)
+
+	// pseudo instructions of the intermediate code, CLIFunction::generateFunction turns them into
+	// debug info (CLFunction::lines)
+	OP_LINE = NUM_OPCODES, // the following instructions are on source line <i>
+};
+
+// register code operands >= CL_RK_CONSTANT refer to function constants
+#define CL_RK_CONSTANT 256
+
+// maximum number of registers of a register code function
+#define CL_MAX_REGISTERS 256
+
+// instruction sets generated by the compiler
+enum CLCodeType
+{
+	CL_STACK_CODE,    // stack machine code (default)
+	CL_REGISTER_CODE, // register machine code, locals and temporaries live in the frame's registers
 };
 
 enum CLArgType
 {
 	ARG_NONE,
 	ARG_INTEGER,
-	ARG_FLOAT,
-	ARG_STRING,
+	ARG_FLOAT,      // stored in CLFunction::floats, instruction argument is the index
 };
 
 struct CLOpcodeDesc
@@ -111,6 +202,7 @@ struct CLOpcodeDesc
 	CLOpcode op;
 	char *name;
 	CLArgType arg_type;
+	bool registers; // uses operands a, b (register code and superinstructions)
 };
 
 extern CLOpcodeDesc getOpcodeDesc(CLOpcode op);
@@ -30,24 +30,24 @@
 #include <iomanip>
 #include <fstream>
 
-CLCompiler::CLCompiler(CLLexer &lexer) : lexer(lexer), last_lineop(-1), l(TOK_ERROR), fp(0), stack_usage(0)
+CLCompiler::CLCompiler(CLLexer &lexer, CLCodeType code_type) : lexer(lexer), code_type(code_type), last_lineop(-1), l(TOK_ERROR), fp(0), stack_usage(0)
 { 
 }
 
 // static member
-CLValue CLCompiler::compile(std::istream &input)
+CLValue CLCompiler::compile(std::istream &input, CLCodeType code_type)
 {
 	CLLexer lexer(input);
-	CLCompiler comp(lexer);
+	CLCompiler comp(lexer, code_type);
 	return comp.compile();
 }
 
 // static member
-CLValue CLCompiler::compile(const std::string &path)
+CLValue CLCompiler::compile(const std::string &path, CLCodeType code_type)
 {
 	std::ifstream input(path.c_str());
 	CLLexer lexer(input, path);
-	CLCompiler comp(lexer);
+	CLCompiler comp(lexer, code_type);
 	return comp.compile();
 }
 
@@ -93,9 +93,31 @@ void CLCompiler::addLineOp(int line)
 	last_lineop = l;
 }
 
-void CLCompiler::addFileOp(const std::string &file)
+// Add the jump of a condition. If the condition ends with a comparison, the comparison becomes a
+// nop and the jump a compare-and-branch instruction.
+void CLCompiler::addConditionalJump(CLIInstruction *jump_if_false)
 {
-	fp->addInstruction(new CLIInstruction(OP_FILE, file));
+	CLIInstruction *last = fp->getLastInstruction();
+	if (last && jump_if_false->op == OP_JMPF)
+	{
+		CLOpcode op = OP_NOP;
+		switch (last->op)
+		{
+			case OP_EQ:  op = OP_EQJMPF; break;
+			case OP_NEQ: op = OP_NEQJMPF; break;
+			case OP_LT:  op = OP_LTJMPF; break;
+			case OP_GT:  op = OP_GTJMPF; break;
+			case OP_LE:  op = OP_LEJMPF; break;
+			case OP_GE:  op = OP_GEJMPF; break;
+			default: break;
+		}
+		if (op != OP_NOP)
+		{
+			last->op = OP_NOP; // stays in place, it may be a jump target
+			jump_if_false->op = op;
+		}
+	}
+	fp->addInstruction(jump_if_false);
 }
 
 CLValue CLCompiler::compile()
@@ -160,13 +182,18 @@ void CLCompiler::statement()
 				fp->addInstruction(new CLIInstruction(OP_PUSH0));
 			} else { // optional expression to return
 				expressionExpr();
+
+				// returning a call's result directly: make it a tail call. The instructions
+				// following it become unreachable.
+				int n = fp->getInstructionCount();
+				while (n > 0 && fp->getInstruction(n-1)->op == OP_LINE) --n;
+				if (n > 0 && fp->getInstruction(n-1)->op == OP_MCALL)
+				{
+					fp->getInstruction(n-1)->op = OP_TAILCALL;
+				}
 			}
 			expect(CLToken(')'));
 
-			// clear local variables....
-			int in_scope = fp->getLocalsInScope();
-			if (in_scope) fp->addInstruction(new CLIInstruction(OP_DELL, in_scope));
-
 			// add return opcode
 			fp->addInstruction(new CLIInstruction(OP_RET));
 			break;
@@ -230,7 +257,7 @@ void CLCompiler::statement()
 
 				// add function object to root table
 				fp->addInstruction(new CLIInstruction(OP_PUSHROOT)); // push self table
-				fp->addInstruction(new CLIInstruction(OP_PUSHS, func_id)); // push key
+				pushStringConstant(func_id); // push key
 				fp->addInstruction(new CLIInstruction(OP_PUSHCONST, f_id)); // push function
 				fp->addInstruction(new CLIInstruction(OP_TABSET)); // make table entry
 				fp->addInstruction(new CLIInstruction(OP_POP, 1)); // discard tabset result
@@ -263,8 +290,10 @@ void CLCompiler::statement()
 CLIFunction *CLCompiler::compileFunction(bool root)
 {
 	CLIFunction *old_fp = fp;
-	CLIFunction *new_fp = new CLIFunction();
+	CLIFunction *new_fp = new CLIFunction(code_type);
 	fp = new_fp;
+	int old_lineop = last_lineop;
+	last_lineop = -1; // the new function needs its own line info
 
 #ifdef DEBUG
 	if (stack_usage != 0)
@@ -275,7 +304,7 @@ CLIFunction *CLCompiler::compileFunction(bool root)
 #endif
 
 	// add debug info
-	addFileOp(lexer.getFile());
+	fp->setFile(lexer.getFile());
 
 	if (root)
 	{
@@ -312,6 +341,7 @@ CLIFunction *CLCompiler::compileFunction(bool root)
 	}
 
 	fp = old_fp;
+	last_lineop = old_lineop;
 	return new_fp;
 }
 
@@ -347,15 +377,15 @@ void CLCompiler::whileStatement()
 	expressionExpr();
 	expect(CLToken(')'));
 
-	fp->addInstruction(loop_jump_toexit = new CLIInstruction(OP_JMPF, -1));
+	addConditionalJump(loop_jump_toexit = new CLIInstruction(OP_JMPF, -1));
 
 	// <statement>
-	fp->beginBlock(loop_exit);
+	fp->beginBlock(loop_exit, stack_usage);
 	statement();
 	fp->endBlock();
 	fp->addInstruction(loop_jump_tostart = new CLIInstruction(OP_JMP, -1));
 
-	fp->addInstruction(loop_exit);
+	fp->addBreakTarget(loop_exit);
 
 	loop_jump_tostart->jump_target = loop_start;
 	loop_jump_toexit->jump_target = loop_exit;
@@ -412,7 +442,7 @@ void CLCompiler::forStatement()
 	if (l.tok != ';')
 	{
 		expressionExpr(); // expr b
-		fp->addInstruction(loop_jump_toexit);
+		addConditionalJump(loop_jump_toexit);
 	} 
 	expect(CLToken(';'));
 
@@ -429,11 +459,11 @@ void CLCompiler::forStatement()
 
 	fp->addInstruction(loop_jump_tostart);
 	fp->addInstruction(loop_begin);
-	fp->beginBlock(loop_exit);
+	fp->beginBlock(loop_exit, stack_usage);
 	statement();
 	fp->endBlock();
 	fp->addInstruction(loop_jump_toincr);
-	fp->addInstruction(loop_exit);
+	fp->addBreakTarget(loop_exit);
 }
 
 void CLCompiler::foreachStatement()
@@ -504,13 +534,13 @@ void CLCompiler::foreachStatement()
 	fp->addInstruction(new CLIInstruction(OP_POPL, val_id));
 	
 	stack_usage += 2;
-		fp->beginBlock(loop_exit);
+		fp->beginBlock(loop_exit, stack_usage);
 		statement();
 		fp->endBlock();
 	stack_usage -= 2;
 
 	fp->addInstruction(loop_jmp_to_start);
-	fp->addInstruction(loop_exit);
+	fp->addBreakTarget(loop_exit);
 }
 
 void CLCompiler::ifStatement()
@@ -528,7 +558,7 @@ void CLCompiler::ifStatement()
 	expressionExpr();
 	expect(CLToken(')'));
 	
-	fp->addInstruction(jump_if_false = new CLIInstruction(OP_JMPF, -1));
+	addConditionalJump(jump_if_false = new CLIInstruction(OP_JMPF, -1));
 	
 	fp->beginBlock();
 	statement();
@@ -563,7 +593,6 @@ void CLCompiler::breakStatement()
 	lex();
 
 	int level = 1;
-	int locals_to_pop;
 
 	expect(CLToken('('));
 
@@ -576,13 +605,19 @@ void CLCompiler::breakStatement()
 
 	expect(CLToken(')'));
 	
-	CLIInstruction *jmp, *break_tgt = fp->getBreakTarget(locals_to_pop, level);
+	int tgt_stack_usage = 0;
+	CLIInstruction *jmp, *break_tgt = fp->getBreakTarget(level, &tgt_stack_usage);
 	if (!break_tgt)
 	{
 		error("parse", "break must be inside at least %i loop(s)", level);
 	}
 
-	if (locals_to_pop > 0) fp->addInstruction(new CLIInstruction(OP_DELL, locals_to_pop));
+	// clear the stack of the switch/foreach statements left by the jump
+	if (stack_usage > tgt_stack_usage)
+	{
+		fp->addInstruction(new CLIInstruction(OP_POP, stack_usage - tgt_stack_usage));
+	}
+
 	fp->addInstruction(jmp = new CLIInstruction(OP_JMP, -1));
 	jmp->jump_target = break_tgt;
 }
@@ -599,18 +634,19 @@ void CLCompiler::localStatement()
 		var_name = l.str;
 
 		fp->addLocal(var_name);
-		fp->addInstruction(new CLIInstruction(OP_ADDL, 1));
 		
 		lex(); // accept TOK_IDENTIFIER
 
-		if (l.tok == '=') // optional initializer?
+		if (l.tok == '=') // optional initializer? (default: null)
 		{
 			lex();
 			expressionExpr();
-			int id = fp->getLocal(var_name);
-			//assert(id != -1);
-			fp->addInstruction(new CLIInstruction(OP_POPL, id));
+		} else {
+			fp->addInstruction(new CLIInstruction(OP_PUSH0));
 		}
+		int id = fp->getLocal(var_name);
+		//assert(id != -1);
+		fp->addInstruction(new CLIInstruction(OP_POPL, id));
 
 		if (l.tok != ',') break;
 		expect(CLToken(','));
@@ -642,6 +678,14 @@ void CLCompiler::switchStatement()
 	//   <stmtE>        // optional
 	// done:
 	//   pop 1
+	//
+	// If all case labels are integer or all are string literals, the case tests are
+	// replaced by a single jump table lookup:
+	//   <expr>
+	//   switch       // jumps to the matching <stmtX>, <stmtE> or done
+	//   <stm1>
+	//   jmp done
+	//   ...
 
 	// push <expr> on stack
 	expect(CLToken('(')); expressionExpr(); expect(CLToken(')'));
@@ -650,6 +694,12 @@ void CLCompiler::switchStatement()
 
 	CLIInstruction *nextI, *jmpI, *jmpDone;
 	CLIInstruction *done = new CLIInstruction(OP_POP, 1); // done target 
+	CLIInstruction *tableI = new CLIInstruction(OP_NOP); // becomes OP_SWITCH if a jump table is used
+	fp->addInstruction(tableI);
+
+	// case tests (first, last instruction) which are removed if a jump table is used
+	std::vector<std::pair<int, int> > tests;
+	bool use_table = true;
 
 	bool bdone = false;
 	bool got_else = false;
@@ -658,22 +708,31 @@ void CLCompiler::switchStatement()
 		switch (l.tok)
 		{
 			case TOK_CASE:
+			{
 				expect(TOK_CASE);
 				if (got_else) error("parse", "in switch statement: 'case' after 'else' not allowed"); 
 				nextI = new CLIInstruction(OP_NOP);
+				int first = fp->getInstructionCount();
 				fp->addInstruction(new CLIInstruction(OP_DUP, 0));
 				expect(CLToken('(')); expressionExpr(); expect(CLToken(')'));
+				if (use_table) use_table = addCaseLabel(tableI, first + 1, fp->getInstructionCount());
 				fp->addInstruction(new CLIInstruction(OP_EQ));
-				fp->addInstruction(jmpI = new CLIInstruction(OP_JMPF)); jmpI->jump_target = nextI;
-				stack_usage += 1; fp->beginBlock(done); statement(); fp->endBlock(); stack_usage -= 1;
+				addConditionalJump(jmpI = new CLIInstruction(OP_JMPF)); jmpI->jump_target = nextI;
+				tests.push_back(std::make_pair(first, fp->getInstructionCount()));
+				CLIInstruction *bodyI = new CLIInstruction(OP_NOP);
+				fp->addInstruction(bodyI);
+				tableI->case_targets.push_back(bodyI);
+				stack_usage += 1; fp->beginBlock(done, stack_usage); statement(); fp->endBlock(); stack_usage -= 1;
 				fp->addInstruction(jmpDone = new CLIInstruction(OP_JMP)); jmpDone->jump_target = done;
 				fp->addInstruction(nextI);
 				break;
+			}
 
 			case TOK_ELSE:
 				expect(TOK_ELSE);
 				got_else = true;
-				stack_usage += 1; fp->beginBlock(done); statement(); fp->endBlock(); stack_usage -= 1;
+				fp->addInstruction(tableI->jump_target = new CLIInstruction(OP_NOP));
+				stack_usage += 1; fp->beginBlock(done, stack_usage); statement(); fp->endBlock(); stack_usage -= 1;
 				break;
 
 			case CLToken('}'):
@@ -688,7 +747,73 @@ void CLCompiler::switchStatement()
 	}
 	
 	// discard <expr> result
-	fp->addInstruction(done);
+	fp->addBreakTarget(done);
+
+	if (use_table && tests.size() >= CL_SWITCH_MIN_CASES && tableI->case_labels[0].type() == CL_INTEGER)
+	{
+		// integer labels must be dense enough
+		std::vector<CLValue> &labels = tableI->case_labels;
+		int min = GET_INTEGER(labels[0]), max = min;
+		for (size_t i=0; i<labels.size(); ++i)
+		{
+			if (GET_INTEGER(labels[i]) < min) min = GET_INTEGER(labels[i]);
+			if (GET_INTEGER(labels[i]) > max) max = GET_INTEGER(labels[i]);
+		}
+		use_table = double(max) - double(min) < double(CL_SWITCH_MAX_SPREAD) * labels.size();
+	}
+
+	if (use_table && tests.size() >= CL_SWITCH_MIN_CASES)
+	{
+		if (tableI->jump_target == 0) tableI->jump_target = done;
+		tableI->op = OP_SWITCH;
+		tableI->arg = 0; // jump table index, set by CLIFunction::generateFunction
+		for (size_t i=0; i<tests.size(); ++i)
+		{
+			for (int j=tests[i].first; j<tests[i].second; ++j)
+			{
+				CLIInstruction *iinst = fp->getInstruction(j);
+				if (iinst->op == OP_LINE)
+				{
+					// keep the line number, the case body starts there now
+					tableI->case_targets[i]->op = OP_LINE;
+					tableI->case_targets[i]->arg = iinst->arg;
+				}
+				iinst->op = OP_NOP;
+				iinst->jump_target = 0;
+			}
+		}
+	} else {
+		tableI->jump_target = 0;
+		tableI->case_targets.clear();
+		tableI->case_labels.clear();
+	}
+}
+
+bool CLCompiler::addCaseLabel(CLIInstruction *tableI, int first, int last)
+{
+	// case label must be an integer literal, a negated integer literal or a string literal
+	std::vector<CLIInstruction*> code;
+	for (int i=first; i<last; ++i)
+	{
+		if (fp->getInstruction(i)->op != OP_LINE) code.push_back(fp->getInstruction(i));
+	}
+
+	CLValue label;
+	if (code.size() == 1 && code[0]->op == OP_PUSHI)
+	{
+		label = CLValue(code[0]->arg);
+	} else if (code.size() == 2 && code[0]->op == OP_PUSHI && code[1]->op == OP_NEG) {
+		label = CLValue(-code[0]->arg);
+	} else if (code.size() == 1 && code[0]->op == OP_PUSHCONST && fp->getConstant(code[0]->arg).type() == CL_STRING) {
+		label = fp->getConstant(code[0]->arg);
+	} else {
+		return false;
+	}
+
+	std::vector<CLValue> &labels = tableI->case_labels;
+	if (!labels.empty() && labels[0].type() != label.type()) return false;
+	labels.push_back(label);
+	return true;
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -702,24 +827,70 @@ void CLCompiler::expressionExpr()
 
 void CLCompiler::logicalOrExpr()
 {
+	// a or b or ..: evaluation stops at the first true operand, the result is True() or False()
+	//
+	//          <a>
+	//          jmpt is_true
+	//          <b>
+	//          jmpt is_true
+	//          ..
+	//          push0
+	//          jmp done
+	// is_true: pushi 1
+	// done:    nop
+
 	logicalAndExpr();
-	for (;;) switch (l.tok)
+	if (l.tok != TOK_OR) return;
+
+	CLIInstruction *is_true = new CLIInstruction(OP_PUSHI, 1);
+	CLIInstruction *done = new CLIInstruction(OP_NOP);
+	CLIInstruction *jmp;
+
+	while (l.tok == TOK_OR)
 	{
-		case TOK_OR: lex(); logicalAndExpr(); fp->addInstruction(new CLIInstruction(OP_OR)); break;
-		default: goto done;
+		lex();
+		fp->addInstruction(jmp = new CLIInstruction(OP_JMPT, -1)); jmp->jump_target = is_true;
+		logicalAndExpr();
 	}
-done:;
+	fp->addInstruction(jmp = new CLIInstruction(OP_JMPT, -1)); jmp->jump_target = is_true;
+	fp->addInstruction(new CLIInstruction(OP_PUSH0));
+	fp->addInstruction(jmp = new CLIInstruction(OP_JMP, -1)); jmp->jump_target = done;
+	fp->addInstruction(is_true);
+	fp->addInstruction(done);
 }
 
 void CLCompiler::logicalAndExpr()
 {
+	// a and b and ..: evaluation stops at the first false operand, the result is True() or False()
+	//
+	//           <a>
+	//           jmpf is_false       (or compare-and-branch, see addConditionalJump)
+	//           <b>
+	//           jmpf is_false
+	//           ..
+	//           pushi 1
+	//           jmp done
+	// is_false: push0
+	// done:     nop
+
 	bitwiseOrExpr();
-	for (;;) switch (l.tok)
+	if (l.tok != TOK_AND) return;
+
+	CLIInstruction *is_false = new CLIInstruction(OP_PUSH0);
+	CLIInstruction *done = new CLIInstruction(OP_NOP);
+	CLIInstruction *jmp;
+
+	while (l.tok == TOK_AND)
 	{
-		case TOK_AND: lex(); bitwiseOrExpr(); fp->addInstruction(new CLIInstruction(OP_AND)); break;
-		default: goto done;
+		lex();
+		addConditionalJump(jmp = new CLIInstruction(OP_JMPF, -1)); jmp->jump_target = is_false;
+		bitwiseOrExpr();
 	}
-done:;
+	addConditionalJump(jmp = new CLIInstruction(OP_JMPF, -1)); jmp->jump_target = is_false;
+	fp->addInstruction(new CLIInstruction(OP_PUSHI, 1));
+	fp->addInstruction(jmp = new CLIInstruction(OP_JMP, -1)); jmp->jump_target = done;
+	fp->addInstruction(is_false);
+	fp->addInstruction(done);
 }
 
 void CLCompiler::bitwiseOrExpr()
@@ -822,11 +993,9 @@ void CLCompiler::factorExpr()
 				lex();
 				suffixedExpr(SUF_LOCAL, id);
 			} else { // ..or it is a global variable
-				fp->addInstruction(new CLIInstruction(OP_PUSHROOT));
-				fp->addInstruction(new CLIInstruction(OP_PUSHCONST, fp->addStringConstant(l.str)));
-
+				int name_id = fp->addStringConstant(l.str);
 				lex();
-				suffixedExpr(SUF_TABLE);
+				suffixedExpr(SUF_GLOBAL, name_id);
 			}
 			break;
 		}
@@ -921,7 +1090,7 @@ void CLCompiler::factorExpr()
 			lex();
 			expect(TOK_FUNCTION);
 			if (l.tok != TOK_IDENTIFIER) error("parse", "Expected identifier after 'external function'");
-			fp->addInstruction(new CLIInstruction(OP_PUSHEXTFUNC, l.str));
+			fp->addInstruction(new CLIInstruction(OP_PUSHCONST, fp->addExternalFunctionConstant(l.str)));
 			lex();
 			suffixedExpr(SUF_EXPR);
 			break;	
@@ -970,6 +1139,10 @@ void CLCompiler::suffixedExpr(Suffixed suf, int lid)
 				fp->addInstruction(new CLIInstruction(OP_DUP, 0));
 				fp->addInstruction(new CLIInstruction(OP_POPL, lid)); 
 				break;
+			case SUF_GLOBAL: 
+				fp->addInstruction(new CLIInstruction(OP_DUP, 0));
+				fp->addInstruction(new CLIInstruction(OP_SETGLOBAL, lid)); 
+				break;
 			default: assert(0);
 		}
 		return;
@@ -982,6 +1155,7 @@ void CLCompiler::suffixedExpr(Suffixed suf, int lid)
 	{ \
 		case SUF_TABLE: fp->addInstruction(new CLIInstruction(OP_TABGET)); break; \
 		case SUF_LOCAL: fp->addInstruction(new CLIInstruction(OP_PUSHL, lid)); break; \
+		case SUF_GLOBAL: fp->addInstruction(new CLIInstruction(OP_GETGLOBAL, lid)); break; \
 		case SUF_EXPR: break; /* already on stack.. */ \
 		default: assert(0); \
 	};
@@ -1013,7 +1187,12 @@ void CLCompiler::suffixedExpr(Suffixed suf, int lid)
 			//addLineOp();
 			lex();
 
-			if (suf != SUF_TABLE)
+			if (suf == SUF_GLOBAL)
+			{
+				// global function: root table is self
+				TOSTACK;
+				fp->addInstruction(new CLIInstruction(OP_PUSHROOT));
+			} else if (suf != SUF_TABLE)
 			{
 				// no table specified? use current object as table (self)
 				TOSTACK;
@@ -1034,7 +1213,6 @@ void CLCompiler::suffixedExpr(Suffixed suf, int lid)
 			// top -> argc
 
 			fp->addInstruction(new CLIInstruction(OP_MCALL));
-			addFileOp(lexer.getFile());
 			suffixedExpr(SUF_EXPR);
 			break; 
 		}
@@ -1112,7 +1290,7 @@ void CLCompiler::tableConstructorExpr()
 				int f_id = fp->addConstant(func);
 
 				fp->addInstruction(new CLIInstruction(OP_DUP, 0)); // push table 
-				fp->addInstruction(new CLIInstruction(OP_PUSHS, func_id)); // push function id/name
+				pushStringConstant(func_id); // push function id/name
 				fp->addInstruction(new CLIInstruction(OP_PUSHCONST, f_id)); // push function onto stack
 				fp->addInstruction(new CLIInstruction(OP_TABSET));
 				fp->addInstruction(new CLIInstruction(OP_POP, 1)); // discard tabset result
@@ -1217,7 +1395,7 @@ void CLCompiler::eventStatement()
 	expect(CLToken(':'));
 
 	// new event function
-	CLIFunction *event_fn = new CLIFunction();
+	CLIFunction *event_fn = new CLIFunction(code_type);
 	event_fn->beginBlock();
 	
 	// parse parameter list
@@ -1248,7 +1426,7 @@ void CLCompiler::eventStatement()
 		fp = event_fn;
 
 		// add debug info
-		addFileOp(lexer.getFile());
+		fp->setFile(lexer.getFile());
 
 		expect(CLToken('{'));
 		while (l.tok != '}')
@@ -1273,7 +1451,6 @@ void CLCompiler::eventStatement()
 	
 	fp->addInstruction(new CLIInstruction(OP_PUSHI, argc+3)); // (6)
 	fp->addInstruction(new CLIInstruction(OP_MCALL)); 
-	addFileOp(lexer.getFile());
 	fp->addInstruction(new CLIInstruction(OP_POP, 1)); 
 }
 
@@ -29,6 +29,12 @@
 #include <stdexcept>
 #include <fstream>
 
+// switch statements are compiled to a jump table lookup (OP_SWITCH) if they have at least
+// CL_SWITCH_MIN_CASES case labels and integer labels span less than CL_SWITCH_MAX_SPREAD
+// table slots per label
+#define CL_SWITCH_MIN_CASES 3
+#define CL_SWITCH_MAX_SPREAD 4
+
 class CLParserException : public std::runtime_error
 {
 public:
@@ -36,19 +42,21 @@ public:
 };
 
 class CLIFunction;
+class CLIInstruction;
 
 class CLCompiler
 {
 public:
-	CLCompiler(CLLexer &lexer);
+	CLCompiler(CLLexer &lexer, CLCodeType code_type = CL_STACK_CODE);
 	
 	CLValue compile();
 
-	static CLValue compile(const std::string &path);
-	static CLValue compile(std::istream &input);
+	static CLValue compile(const std::string &path, CLCodeType code_type = CL_STACK_CODE);
+	static CLValue compile(std::istream &input, CLCodeType code_type = CL_STACK_CODE);
 
 private:
 	CLLexer &lexer;
+	CLCodeType code_type; // instruction set of generated functions
 
 	void statement();
 	CLIFunction *compileFunction(bool root = false);
@@ -62,6 +70,7 @@ private:
 	void ifStatement();
 	void breakStatement();
 	void switchStatement();
+	bool addCaseLabel(CLIInstruction *switch_table, int first, int last);
 
 #ifdef MINDBENDER_EXT
 	void eventStatement();
@@ -86,14 +95,15 @@ private:
 	void functionExpr();
 
 	void addLineOp(int line = -1);
+	void addConditionalJump(CLIInstruction *jump_if_false);
 	int last_lineop; 
 
-	void addFileOp(const std::string &file);
 
 	enum Suffixed // any expression, which might be followed by:    = [ ( .    (except "arithmetic" parenthesis)
 	{
 		SUF_TABLE, // a table (2 values on stack: tab|key pair)
 		SUF_LOCAL, // a local variable (number given as 'lid' parameter in suffixedExpr below..)
+		SUF_GLOBAL,// a global variable (name constant given as 'lid' parameter in suffixedExpr below..)
 		SUF_EXPR,  // any other expression on stack (e.g. self, global, (<expr>) ) 
 	};
 
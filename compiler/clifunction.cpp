@@ -20,19 +20,24 @@
 
 
 #include "compiler/clifunction.h"
+#include "compiler/clregtranslator.h"
+#include "compiler/clpeephole.h"
 #include "value/clfunction.h"
 #include "value/clstring.h"
+#include "value/clexternalfunction.h"
+#include "vm/clverifier.h"
 
 #include <assert.h>
 
 #include <algorithm>
 #include <cstring>
+#include <stdexcept>
 
 #include <iostream>
 using namespace std;
 
-CLIFunction::CLIFunction()
-	: num_args(0)
+CLIFunction::CLIFunction(CLCodeType code_type_)
+	: code_type(code_type_), num_args(0), max_locals(0), clear_target(0), clear_first(0)
 {
 }
 
@@ -50,7 +55,7 @@ void CLIFunction::addInstruction(CLIInstruction *iinst)
 	//cout << debugprint_instruction(*iinst) << endl;
 }
 
-void CLIFunction::beginBlock(CLIInstruction *break_target)
+void CLIFunction::beginBlock(CLIInstruction *break_target, int stack_usage)
 {
 	int new_first_id = 0;
 	if (!blocks.empty()) 
@@ -61,30 +66,60 @@ void CLIFunction::beginBlock(CLIInstruction *break_target)
 
 	blocks.push_back(Block()); Block &top = *(blocks.end()-1);
 	top.first_id = new_first_id;
+	top.used = new_first_id;
 	top.break_target = break_target;
+	top.stack_usage = stack_usage;
 }
 
+// The frame holds all locals of the function, so leaving a block doesn't need any code. Only the
+// garbage collector would still see the values of the block's locals, which are cleared where the
+// slots aren't reused soon anyway: at the end of blocks outside of loops, and once at the exit of
+// outermost loops (or switches) instead of in every iteration. The function's block goes with the
+// frame.
 void CLIFunction::endBlock()
 {
 	Block &top = *(blocks.end()-1);
-	int num_to_pop = top.locals.size();
-	if (num_to_pop > 0) addInstruction(new CLIInstruction(OP_DELL, num_to_pop));
+	bool in_loop = false;
+	for (size_t i=0; i+1<blocks.size(); ++i) if (blocks[i].break_target) in_loop = true;
+
+	if (blocks.size() > 1 && top.used > top.first_id && !in_loop)
+	{
+		if (top.break_target)
+		{
+			clear_target = top.break_target;
+			clear_first = top.first_id;
+		} else {
+			addInstruction(new CLIInstruction(OP_CLEARL, top.first_id));
+		}
+	}
 	blocks.pop_back();
 }
 
-CLIInstruction *CLIFunction::getBreakTarget(int &locals_to_pop, int level)
+void CLIFunction::addBreakTarget(CLIInstruction *target)
+{
+	addInstruction(target);
+	if (clear_target == target)
+	{
+		addInstruction(new CLIInstruction(OP_CLEARL, clear_first));
+		clear_target = 0;
+	}
+}
+
+CLIInstruction *CLIFunction::getBreakTarget(int level, int *stack_usage)
 {
 	std::vector<Block>::reverse_iterator it =  blocks.rbegin(), end = blocks.rend();
 	if (it == end) return 0; // error...
 	
-	locals_to_pop = 0;
 	while (level > 0)
 	{
-		locals_to_pop += it->locals.size();
 		if (it->break_target)
 		{
 			--level;
-			if (level == 0) return it->break_target;
+			if (level == 0)
+			{
+				if (stack_usage) *stack_usage = it->stack_usage;
+				return it->break_target;
+			}
 		}
 		++it;
 		if (it == end) return 0; // error...
@@ -108,6 +143,8 @@ void CLIFunction::addLocal(const std::string &name)
 	//cout << "added local variable " << name << endl;
 
 	(blocks.end()-1)->locals.push_back(name);
+	max_locals = std::max(max_locals, getLocalsInScope());
+	for (size_t i=0; i<blocks.size(); ++i) blocks[i].used = std::max(blocks[i].used, getLocalsInScope());
 }
 
 int CLIFunction::getLocal(const std::string &name)
@@ -123,33 +160,88 @@ int CLIFunction::getLocal(const std::string &name)
 	return -1;
 }
 
+// add float to the side table of 'func', returns its index
+static int addFloat(CLFunction *func, double f)
+{
+	for (size_t i=0; i<func->floats.size(); ++i) if (func->floats[i] == f) return static_cast<int>(i);
+	func->floats.push_back(f);
+	return static_cast<int>(func->floats.size()-1);
+}
+
+// add the jump table of switch instruction 'iinst' (with resolved ips) to 'func', returns its index
+static int addSwitchTable(CLFunction *func, CLIInstruction *iinst)
+{
+	CLSwitchTable table;
+	table.type = iinst->case_labels[0].type();
+	for (size_t i=0; i<iinst->case_labels.size(); ++i)
+	{
+		table.addCase(iinst->case_labels[i], iinst->case_targets[i]->ip);
+	}
+	table.default_target = iinst->jump_target->ip;
+	func->switches.push_back(table);
+	return static_cast<int>(func->switches.size()-1);
+}
+
 CLValue CLIFunction::generateFunction()
 {
 	CLFunction *func = new CLFunction;
 
+	// translate to register code (stays stack code if that's not possible)
+	bool translated = false;
+	if (code_type == CL_REGISTER_CODE)
+	{
+		CLRegTranslator translator(icode, constants, num_args, max_locals);
+		translated = translator.translate();
+		if (translated) func->frame_size = translator.getNumRegisters();
+	}
+
+	// optimize stack code, its frame holds the maximum number of locals in scope
+	if (!translated)
+	{
+		CLPeephole peephole(icode, constants);
+		peephole.optimize();
+		func->frame_size = max_locals;
+	}
+
 	// copy constants
 	func->constants = this->constants;
 
-	// 
-	for (size_t i=0; i<icode.size(); ++i) icode[i]->ip = i;
+	// instruction positions (line pseudo instructions are at the following instruction) and
+	// the line table
+	std::vector<std::pair<int, int> > lines;
+	int size = 0;
+	for (size_t i=0; i<icode.size(); ++i)
+	{
+		icode[i]->ip = size;
+		if (icode[i]->op != OP_LINE) ++size;
+		else if (!lines.empty() && lines.back().first == size) lines.back().second = icode[i]->arg;
+		else lines.push_back(std::make_pair(size, icode[i]->arg));
+	}
+	func->file = file;
+	func->setLines(lines);
 
 	// copy/relocate code
 	func->num_args = num_args;
-	func->code.resize(icode.size());
+	func->code.resize(size);
 	for (size_t i=0; i<icode.size(); ++i)
 	{
-		CLInstruction *inst = &func->code[i];
 		CLIInstruction *iinst = icode[i];
+		if (iinst->op == OP_LINE) continue;
+		CLInstruction *inst = &func->code[iinst->ip];
 
-		// copy opcode & args
+		// copy opcode & args (floats go to the side table)
 		inst->op = iinst->op;
 		CLOpcodeDesc desc = getOpcodeDesc(iinst->op);
+		if (desc.registers)
+		{
+			inst->a = iinst->a;
+			inst->b = iinst->b;
+		}
 		switch (desc.arg_type)
 		{
-			case ARG_NONE: break;
+			case ARG_NONE: inst->arg = 0; break;
 			case ARG_INTEGER: inst->arg = iinst->arg; break;
-			case ARG_FLOAT: inst->arg_float = iinst->arg_float; break;
-			case ARG_STRING: inst->arg_str = iinst->arg_str; break;
+			case ARG_FLOAT: inst->arg = addFloat(func, iinst->arg_float); break;
 		}
 
 		// resolve jump targets..
@@ -158,13 +250,27 @@ CLValue CLIFunction::generateFunction()
 			case OP_JMP:
 			case OP_JMPF:
 			case OP_JMPT:
+			case OP_RJMPF:
+			case OP_RJMPT:
+			case OP_EQJMPF: case OP_NEQJMPF: case OP_LTJMPF: case OP_GTJMPF: case OP_LEJMPF: case OP_GEJMPF:
+			case OP_REQJMPF: case OP_RNEQJMPF: case OP_RLTJMPF: case OP_RGTJMPF: case OP_RLEJMPF: case OP_RGEJMPF:
+			case OP_LTLKJMPF:
 				assert(iinst->jump_target);
 				inst->arg = iinst->jump_target->ip;
 				break;
+			case OP_SWITCH:
+			case OP_RSWITCH:
+				inst->arg = addSwitchTable(func, iinst);
+				break;
 			default: break;
 		}
 
 	}
+	func->initCaches();
+
+	// computes the stack size, and catches code generation bugs before they crash the VM
+	CLVerifier verifier(func);
+	if (!verifier.verify()) throw std::runtime_error("Internal compiler error: " + verifier.getError());
 
 	return CLValue(func);
 }
@@ -190,13 +296,27 @@ int CLIFunction::addStringConstant(const std::string &str)
 	for (size_t i=0; i<size; ++i)
 	{
 		CLValue &V = constants[i];
-		if (V.type == CL_STRING && GET_STRING(V)->get() == str) return static_cast<int>(i);
+		if (V.type() == CL_STRING && GET_STRING(V)->get() == str) return static_cast<int>(i);
 	}
 
 	// not found? => Add string constant
 	return addConstant(CLValue(new CLString(str)));
 }
 
+int CLIFunction::addExternalFunctionConstant(const std::string &func_id)
+{
+	// search if constant was already added
+	size_t size = constants.size();
+	for (size_t i=0; i<size; ++i)
+	{
+		CLValue &V = constants[i];
+		if (V.type() == CL_EXTERNALFUNCTION && GET_EXTERNALFUNCTION(V)->getFuncID() == func_id) return static_cast<int>(i);
+	}
+
+	// not found? => Add external function constant
+	return addConstant(CLValue(new CLExternalFunction(func_id)));
+}
+
 int CLIFunction::addConstant(CLValue val)
 {
 	constants.push_back(val);
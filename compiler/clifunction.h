@@ -36,16 +36,21 @@ class CLFunction;
 class CLIFunction
 {
 public:
-	CLIFunction();
+	CLIFunction(CLCodeType code_type = CL_STACK_CODE);
 	~CLIFunction();
 
 	CLValue generateFunction();
 
+	void setFile(const std::string &file) { this->file = file; }
 	void addInstruction(CLIInstruction *iinst);
+	CLIInstruction *getLastInstruction() { return icode.empty() ? 0 : icode.back(); }
+	int getInstructionCount() { return icode.size(); }
+	CLIInstruction *getInstruction(int idx) { return icode[idx]; }
 
-	void beginBlock(CLIInstruction *break_target = 0);
+	void beginBlock(CLIInstruction *break_target = 0, int stack_usage = 0); // stack_usage: operand stack depth at break_target
 	void endBlock();
-	CLIInstruction *getBreakTarget(int &locals_to_pop, int level = 1);
+	void addBreakTarget(CLIInstruction *target); // add the break target of a block (after endBlock())
+	CLIInstruction *getBreakTarget(int level = 1, int *stack_usage = 0);
 
 	void addParameter(const std::string &name);
 	void addLocal(const std::string &name);
@@ -53,19 +58,28 @@ public:
 	int getLocalsInScope();
 
 	int addStringConstant(const std::string &str);
+	int addExternalFunctionConstant(const std::string &func_id);
 	int addConstant(CLValue val);
+	CLValue getConstant(int id) { return constants[id]; }
 
 	bool needReturnGuard();
 
 private:
+	CLCodeType code_type;
+	std::string file; // source file (debug info)
 	int num_args;
+	int max_locals; // maximum number of locals in scope
 	struct Block
 	{
 		int first_id;
+		int used; // first_id + number of slots used by this block and its nested blocks
 		std::vector<std::string> locals;
 		CLIInstruction *break_target; // 0 if this block is not a loop (i.e. breakable)
+		int stack_usage;              // operand stack depth expected at break_target
 	};
 	std::vector<Block> blocks;
+	CLIInstruction *clear_target; // addBreakTarget() clears the locals from #clear_first after this
+	int clear_first;
 	
 	std::vector<CLIInstruction*> icode;	// intermediate code
 	std::vector<CLValue> constants;
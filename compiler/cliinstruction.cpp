@@ -31,12 +31,17 @@ std::string debugprint_instruction(const CLIInstruction &iinst)
 
 	result << desc.name << " ";
 
+	if (desc.registers)
+	{
+		result << "r" << iinst.a << " ";
+		if (iinst.b < CL_RK_CONSTANT) result << "r" << iinst.b << " "; else result << "k" << iinst.b - CL_RK_CONSTANT << " ";
+	}
+
 	switch (desc.arg_type)
 	{
 		case ARG_NONE: break;
 		case ARG_INTEGER: result << iinst.arg; break;
 		case ARG_FLOAT: result << iinst.arg_float; break;
-		case ARG_STRING: result << iinst.arg_str; break;
 	}
 
 	return result.str();
@@ -23,25 +23,31 @@
 #define CLIINSTRUCTION_H
 
 #include <string>
+#include <vector>
 
 #include "clopcode.h"
+#include "value/clvalue.h"
 
 struct CLIInstruction	// intermediate intruction
 {
-	CLIInstruction(CLOpcode op_) : op(op_), jump_target(0) {}
-	CLIInstruction(CLOpcode op_, int arg_) : op(op_), arg(arg_), jump_target(0) {}
-	CLIInstruction(CLOpcode op_, float arg_float_) : op(op_), arg_float(arg_float_), jump_target(0) {}
-	CLIInstruction(CLOpcode op_, std::string arg_str_) : op(op_), arg_str(arg_str_), jump_target(0) {}
+	CLIInstruction(CLOpcode op_) : op(op_), jump_target(0), a(0), b(0) {}
+	CLIInstruction(CLOpcode op_, int arg_) : op(op_), arg(arg_), jump_target(0), a(0), b(0) {}
+	CLIInstruction(CLOpcode op_, double arg_float_) : op(op_), arg_float(arg_float_), jump_target(0), a(0), b(0) {}
+	CLIInstruction(CLOpcode op_, int a_, int b_, int arg_) : op(op_), arg(arg_), jump_target(0), a(a_), b(b_) {}
 
 	CLOpcode op;
 	int arg;
-	float arg_float;
-	std::string arg_str;
+	double arg_float;
 	class CLFunction *arg_func;
 
 	CLIInstruction *jump_target; // unrsolved jump target
+
+	std::vector<CLValue> case_labels; // OP_SWITCH, OP_RSWITCH: case labels..
+	std::vector<CLIInstruction*> case_targets; // ..and their jump targets (jump_target is the default target)
 	
 	int ip; // position in function
+
+	int a, b; // register operands (register code)
 };
 
 extern std::string debugprint_instruction(const CLIInstruction &iinst);
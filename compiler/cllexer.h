@@ -94,7 +94,7 @@ struct CLLexeme
 	CLToken tok;
 	std::string str;
 	int integer;
-	float real;
+	double real;
 };
 
 class CLLexer
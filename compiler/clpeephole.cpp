@@ -0,0 +1,312 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "compiler/clpeephole.h"
+
+#include <map>
+#include <iostream>
+#include <iomanip>
+
+bool CLPeephole::dump = false;
+
+CLPeephole::CLPeephole(std::vector<CLIInstruction*> &icode_, std::vector<CLValue> &constants_)
+	: icode(icode_), constants(constants_)
+{
+}
+
+void CLPeephole::optimize()
+{
+	if (dump) dumpListing("before peephole optimization");
+
+	removePads();
+	threadJumps();
+	foldConstantBranches();
+	threadJumps();
+	removeDeadCode();
+	removePads();
+	fuse();
+
+	if (dump) dumpListing("after peephole optimization");
+}
+
+// remove nops and jumps to the next instruction, jumps to them go to the following instruction
+void CLPeephole::removePads()
+{
+	std::map<CLIInstruction*, CLIInstruction*> pads; // removed instruction => replacement target
+	CLIInstruction *next = 0;                       // next instruction which is kept
+
+	for (size_t i=icode.size(); i-- > 0; )
+	{
+		CLIInstruction *iinst = icode[i];
+		bool pad = false;
+		if (next)
+		{
+			if (iinst->op == OP_NOP) pad = true;
+			else if (iinst->op == OP_JMP)
+			{
+				CLIInstruction *target = iinst->jump_target;
+				if (pads.count(target)) target = pads[target];
+				pad = target == next;
+			}
+		}
+
+		if (pad) pads[iinst] = next;
+		else next = iinst;
+	}
+	if (pads.empty()) return;
+
+	std::vector<CLIInstruction*> out;
+	for (size_t i=0; i<icode.size(); ++i)
+	{
+		CLIInstruction *iinst = icode[i];
+		if (pads.count(iinst))
+		{
+			delete iinst;
+			continue;
+		}
+		if (iinst->jump_target && pads.count(iinst->jump_target)) iinst->jump_target = pads[iinst->jump_target];
+		for (size_t j=0; j<iinst->case_targets.size(); ++j)
+		{
+			if (pads.count(iinst->case_targets[j])) iinst->case_targets[j] = pads[iinst->case_targets[j]];
+		}
+		out.push_back(iinst);
+	}
+	icode.swap(out);
+}
+
+// jumps to unconditional jumps go to their target directly
+void CLPeephole::threadJumps()
+{
+	for (size_t i=0; i<icode.size(); ++i)
+	{
+		CLIInstruction *iinst = icode[i];
+		if (!iinst->jump_target) continue;
+
+		// limit the number of hops, there may be endless loops
+		for (int hops=0; hops<8 && iinst->jump_target->op == OP_JMP; ++hops)
+		{
+			iinst->jump_target = iinst->jump_target->jump_target;
+		}
+		for (size_t j=0; j<iinst->case_targets.size(); ++j)
+		{
+			for (int hops=0; hops<8 && iinst->case_targets[j]->op == OP_JMP; ++hops)
+			{
+				iinst->case_targets[j] = iinst->case_targets[j]->jump_target;
+			}
+		}
+	}
+}
+
+// push0/pushi followed by (a jump to) jmpt/jmpf: jump to where the branch goes
+void CLPeephole::foldConstantBranches()
+{
+	for (size_t i=0; i<icode.size(); ++i) icode[i]->ip = i;
+
+	for (size_t i=0; i+1<icode.size(); ++i)
+	{
+		CLIInstruction *iinst = icode[i];
+		if (iinst->op != OP_PUSH0 && iinst->op != OP_PUSHI) continue;
+
+		CLIInstruction *branch = icode[i+1];
+		if (branch->op == OP_JMP) branch = branch->jump_target;
+		if (branch->op != OP_JMPT && branch->op != OP_JMPF) continue;
+		if (static_cast<size_t>(branch->ip) + 1 >= icode.size()) continue;
+
+		bool taken = (iinst->op == OP_PUSHI) == (branch->op == OP_JMPT);
+		iinst->op = OP_JMP;
+		iinst->arg = -1;
+		iinst->jump_target = taken ? branch->jump_target : icode[branch->ip + 1];
+	}
+}
+
+// remove instructions which can't be reached
+void CLPeephole::removeDeadCode()
+{
+	size_t n = icode.size();
+	for (size_t i=0; i<n; ++i) icode[i]->ip = i;
+
+	std::vector<bool> reached(n, false);
+	std::vector<size_t> worklist;
+	if (n > 0) worklist.push_back(0);
+	while (!worklist.empty())
+	{
+		size_t i = worklist.back(); worklist.pop_back();
+		if (i >= n || reached[i]) continue;
+		reached[i] = true;
+
+		CLIInstruction *iinst = icode[i];
+		if (iinst->jump_target) worklist.push_back(iinst->jump_target->ip);
+		for (size_t j=0; j<iinst->case_targets.size(); ++j) worklist.push_back(iinst->case_targets[j]->ip);
+		if (iinst->op != OP_JMP && iinst->op != OP_RET && iinst->op != OP_SWITCH && iinst->op != OP_TAILCALL) worklist.push_back(i+1);
+	}
+
+	std::vector<CLIInstruction*> out;
+	for (size_t i=0; i<n; ++i)
+	{
+		if (reached[i]) out.push_back(icode[i]);
+		else delete icode[i];
+	}
+	icode.swap(out);
+}
+
+bool CLPeephole::isFree(size_t i)
+{
+	return i < icode.size() && targets.find(icode[i]) == targets.end();
+}
+
+int CLPeephole::operandLK(CLIInstruction *push)
+{
+	switch (push->op)
+	{
+		case OP_PUSHL:
+			return push->arg < CL_RK_CONSTANT ? push->arg : -1;
+
+		case OP_PUSHCONST:
+			return CL_RK_CONSTANT + push->arg <= 0xffff ? CL_RK_CONSTANT + push->arg : -1;
+
+		case OP_PUSHI:
+		{
+			size_t i;
+			for (i=0; i<constants.size(); ++i)
+			{
+				if (constants[i].type() == CL_INTEGER && GET_INTEGER(constants[i]) == push->arg) break;
+			}
+			if (CL_RK_CONSTANT + i > 0xffff) return -1;
+			if (i == constants.size()) constants.push_back(CLValue(push->arg));
+			return CL_RK_CONSTANT + static_cast<int>(i);
+		}
+
+		default:
+			return -1;
+	}
+}
+
+// fuse instruction sequences into superinstructions. The first instruction of a sequence is
+// changed in place (so jumps to it stay valid), the other ones must not be jump targets.
+void CLPeephole::fuse()
+{
+	targets.clear();
+	for (size_t i=0; i<icode.size(); ++i)
+	{
+		if (icode[i]->jump_target) targets.insert(icode[i]->jump_target);
+		targets.insert(icode[i]->case_targets.begin(), icode[i]->case_targets.end());
+	}
+
+	std::vector<CLIInstruction*> out;
+	for (size_t i=0; i<icode.size(); )
+	{
+		CLIInstruction *iinst = icode[i];
+		int fused = 0; // number of instructions fused into iinst
+
+		// pushl a, push<lk> b, ltjmpf => ltlkjmpf a, b
+		if (iinst->op == OP_PUSHL && iinst->arg < CL_RK_CONSTANT && isFree(i+1) && isFree(i+2)
+			&& icode[i+2]->op == OP_LTJMPF)
+		{
+			int b = operandLK(icode[i+1]);
+			if (b != -1)
+			{
+				iinst->a = iinst->arg;
+				iinst->b = b;
+				iinst->op = OP_LTLKJMPF;
+				iinst->jump_target = icode[i+2]->jump_target;
+				fused = 2;
+			}
+		}
+
+		// pushl a, push<lk> b, add => addlk a, b
+		if (!fused && iinst->op == OP_PUSHL && iinst->arg < CL_RK_CONSTANT && isFree(i+1) && isFree(i+2) 
+			&& icode[i+2]->op == OP_ADD)
+		{
+			int b = operandLK(icode[i+1]);
+			if (b != -1)
+			{
+				iinst->a = iinst->arg;
+				iinst->b = b;
+				iinst->op = OP_ADDLK;
+				fused = 2;
+			}
+		}
+
+		// pushroot, pushconst k, [line n,] tabget => getglobal k, [line n]
+		if (!fused && iinst->op == OP_PUSHROOT && isFree(i+1) && isFree(i+2) && icode[i+1]->op == OP_PUSHCONST)
+		{
+			bool line = icode[i+2]->op == OP_LINE && isFree(i+3);
+			if (icode[i + (line ? 3 : 2)]->op == OP_TABGET)
+			{
+				iinst->op = OP_GETGLOBAL;
+				iinst->arg = icode[i+1]->arg;
+				out.push_back(iinst);
+				delete icode[i+1];
+				if (line) out.push_back(icode[i+2]);
+				delete icode[i + (line ? 3 : 2)];
+				i += line ? 4 : 3;
+				continue;
+			}
+		}
+
+		// dup 0, popl/setglobal x, pop n => popl/setglobal x, pop n-1 (assignment statement)
+		if (!fused && iinst->op == OP_DUP && iinst->arg == 0 && isFree(i+1) && isFree(i+2) 
+			&& (icode[i+1]->op == OP_POPL || icode[i+1]->op == OP_SETGLOBAL) && icode[i+2]->op == OP_POP && icode[i+2]->arg > 0)
+		{
+			iinst->op = icode[i+1]->op;
+			iinst->arg = icode[i+1]->arg;
+			delete icode[i+1];
+			out.push_back(iinst);
+			if (--icode[i+2]->arg == 0) delete icode[i+2];
+			else out.push_back(icode[i+2]);
+			i += 3;
+			continue;
+		}
+
+		// tabset, pop n => tabput, pop n-1
+		if (!fused && iinst->op == OP_TABSET && isFree(i+1) && icode[i+1]->op == OP_POP && icode[i+1]->arg > 0)
+		{
+			iinst->op = OP_TABPUT;
+			out.push_back(iinst);
+			if (--icode[i+1]->arg == 0) delete icode[i+1];
+			else out.push_back(icode[i+1]);
+			i += 2;
+			continue;
+		}
+
+		out.push_back(iinst);
+		for (int j=1; j<=fused; ++j) delete icode[i+j];
+		i += 1 + fused;
+	}
+	icode.swap(out);
+}
+
+void CLPeephole::dumpListing(const char *title)
+{
+	std::cout << "; " << title << std::endl;
+	for (size_t i=0; i<icode.size(); ++i) icode[i]->ip = i;
+	for (size_t i=0; i<icode.size(); ++i)
+	{
+		std::cout << std::setw(6) << i << "  " << debugprint_instruction(*icode[i]);
+		if (icode[i]->jump_target) std::cout << " -> " << icode[i]->jump_target->ip;
+		for (size_t j=0; j<icode[i]->case_targets.size(); ++j)
+		{
+			std::cout << (j ? ", " : " [") << icode[i]->case_labels[j].toString() << " -> " << icode[i]->case_targets[j]->ip;
+			if (j + 1 == icode[i]->case_targets.size()) std::cout << "]";
+		}
+		std::cout << std::endl;
+	}
+}
@@ -0,0 +1,62 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CLPEEPHOLE_H
+#define CLPEEPHOLE_H
+
+#include "compiler/cliinstruction.h"
+
+#include "value/clvalue.h"
+
+#include <vector>
+#include <set>
+
+// Peephole optimizer for the intermediate stack code of a function. Removes jump pads (nops,
+// jumps to the next instruction), shortcuts jumps to jumps, resolves branches on constants
+// (as left by and/or in conditions) and fuses common instruction sequences into superinstructions.
+class CLPeephole
+{
+public:
+	CLPeephole(std::vector<CLIInstruction*> &icode, std::vector<CLValue> &constants);
+
+	void optimize();
+
+	static bool dump; // print listings before and after optimization
+
+private:
+	std::vector<CLIInstruction*> &icode;
+	std::vector<CLValue> &constants;
+
+	std::set<CLIInstruction*> targets; // jump targets
+
+	void removePads();
+	void threadJumps();
+	void foldConstantBranches();
+	void removeDeadCode();
+	void fuse();
+
+	bool isFree(size_t i); // icode[i] exists and is no jump target
+	int operandLK(CLIInstruction *push); // LK operand of a push instruction, -1 if not possible
+
+	void dumpListing(const char *title);
+};
+
+#endif
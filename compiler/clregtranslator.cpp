@@ -0,0 +1,480 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "compiler/clregtranslator.h"
+
+#include <assert.h>
+
+CLRegTranslator::CLRegTranslator(std::vector<CLIInstruction*> &icode_, std::vector<CLValue> &constants_, int num_args_, int num_locals_)
+	: icode(icode_), constants(constants_), num_args(num_args_), num_locals(num_locals_), num_registers(0), failed(false), last_def(-1)
+{
+}
+
+CLRegTranslator::~CLRegTranslator()
+{
+	// on failure, the generated code is still owned by us
+	for (size_t i=0; i<rcode.size(); ++i) delete rcode[i];
+}
+
+// number of operand stack entries consumed and produced by icode[i]. Returns false for unknown instructions.
+bool CLRegTranslator::stackEffect(size_t i, int &pop, int &push)
+{
+	CLIInstruction *iinst = icode[i];
+	pop = 0; push = 0;
+	switch (iinst->op)
+	{
+		case OP_NOP: case OP_CLEARL: case OP_JMP: case OP_LINE: case OP_SWITCH:
+			break;
+
+		case OP_PUSH0: case OP_PUSHSELF: case OP_PUSHROOT: case OP_PUSHCONST:
+		case OP_PUSHI: case OP_PUSHF: case OP_DUP: case OP_NEWTABLE: case OP_NEWARRAY: case OP_PUSHL:
+		case OP_GETGLOBAL:
+			push = 1; break;
+
+		case OP_POP: pop = iinst->arg; break;
+		case OP_TABGET: pop = 2; push = 1; break;
+		case OP_TABGET2: pop = 2; push = 2; break;
+		case OP_TABSET: pop = 3; push = 1; break;
+		case OP_TABIT: pop = 1; push = 2; break;
+		case OP_TABNEXT: pop = 2; push = 4; break;
+
+		case OP_CLONE: case OP_NEG: case OP_NOT:
+			pop = 1; push = 1; break;
+
+		case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MODULO:
+		case OP_BITOR: case OP_BITAND: case OP_BITXOR: case OP_SHL: case OP_SHR:
+		case OP_AND: case OP_OR:
+		case OP_EQ: case OP_NEQ: case OP_LT: case OP_GT: case OP_LE: case OP_GE:
+			pop = 2; push = 1; break;
+
+		case OP_MCALL: case OP_TAILCALL:
+			// argument count is pushed by the preceding instruction
+			if (i == 0 || icode[i-1]->op != OP_PUSHI || labels[i]) return false;
+			pop = icode[i-1]->arg + 3; push = 1; break;
+
+		case OP_POPL: case OP_SETGLOBAL: case OP_RET: case OP_YIELD: case OP_JMPT: case OP_JMPF:
+			pop = 1; break;
+
+		case OP_EQJMPF: case OP_NEQJMPF: case OP_LTJMPF: case OP_GTJMPF: case OP_LEJMPF: case OP_GEJMPF:
+			pop = 2; break;
+
+		default: return false;
+	}
+	return true;
+}
+
+// compute the stack depth at each instruction
+bool CLRegTranslator::analyze()
+{
+	size_t n = icode.size();
+	for (size_t i=0; i<n; ++i) icode[i]->ip = i;
+
+	labels.assign(n, false);
+	for (size_t i=0; i<n; ++i)
+	{
+		if (icode[i]->jump_target) labels[icode[i]->jump_target->ip] = true;
+		for (size_t j=0; j<icode[i]->case_targets.size(); ++j) labels[icode[i]->case_targets[j]->ip] = true;
+	}
+
+	State unreached = { -1 };
+	states.assign(n, unreached);
+	if (n == 0) return true;
+
+	int max_depth = 0;
+	std::vector<size_t> worklist;
+	states[0].depth = 0;
+	worklist.push_back(0);
+	while (!worklist.empty())
+	{
+		size_t i = worklist.back(); worklist.pop_back();
+		CLIInstruction *iinst = icode[i];
+
+		int pop, push;
+		if (!stackEffect(i, pop, push)) return false;
+		if (iinst->op == OP_DUP && iinst->arg >= states[i].depth) return false;
+		if (pop > states[i].depth) return false;
+
+		State next = states[i];
+		next.depth += push - pop;
+		if (next.depth > max_depth) max_depth = next.depth;
+
+		// successors
+		std::vector<size_t> succ;
+		if (iinst->op != OP_JMP && iinst->op != OP_RET && iinst->op != OP_SWITCH && iinst->op != OP_TAILCALL) succ.push_back(i+1);
+		if (iinst->jump_target) succ.push_back(iinst->jump_target->ip);
+		for (size_t j=0; j<iinst->case_targets.size(); ++j) succ.push_back(iinst->case_targets[j]->ip);
+
+		for (size_t s=0; s<succ.size(); ++s)
+		{
+			if (succ[s] >= n) return false; // falls off the end of the code
+			State &S = states[succ[s]];
+			if (S.depth == -1)
+			{
+				S = next;
+				worklist.push_back(succ[s]);
+			}
+			else if (S.depth != next.depth) return false;
+		}
+	}
+
+	num_registers = num_locals + max_depth;
+	return num_registers <= CL_MAX_REGISTERS;
+}
+
+// RK operand of constant 'v'
+int CLRegTranslator::constant(const CLValue &v)
+{
+	size_t i;
+	for (i=0; i<constants.size(); ++i)
+	{
+		// same word: same null/integer/float bit pattern or the same object
+		if (constants[i].value.bits == v.value.bits) break;
+	}
+	if (i == constants.size()) constants.push_back(v);
+
+	if (CL_RK_CONSTANT + i > 0xffff) failed = true; // does not fit into the b operand
+	return CL_RK_CONSTANT + static_cast<int>(i);
+}
+
+void CLRegTranslator::emit(CLIInstruction *rinst)
+{
+	rcode.push_back(rinst);
+	switch (rinst->op)
+	{
+		case OP_RMOVE: case OP_RSELF: case OP_RROOT:
+		case OP_RNEWTABLE: case OP_RNEWARRAY: case OP_RTABGET: case OP_RCLONE: case OP_RGETGLOBAL:
+		case OP_RADD: case OP_RSUB: case OP_RMUL: case OP_RDIV: case OP_RMODULO: case OP_RNEG:
+		case OP_RBITOR: case OP_RBITAND: case OP_RBITXOR: case OP_RSHL: case OP_RSHR:
+		case OP_RAND: case OP_ROR: case OP_RNOT:
+		case OP_REQ: case OP_RNEQ: case OP_RLT: case OP_RGT: case OP_RLE: case OP_RGE:
+			last_def = static_cast<int>(rcode.size()-1); // writes R[a] only
+			break;
+		default:
+			last_def = -1;
+			break;
+	}
+}
+
+void CLRegTranslator::materialize(int depth)
+{
+	int reg = stackReg(depth);
+	if (vstack[depth] == reg) return;
+	emit(new CLIInstruction(OP_RMOVE, reg, vstack[depth], 0));
+	vstack[depth] = reg;
+}
+
+void CLRegTranslator::flush()
+{
+	for (size_t d=0; d<vstack.size(); ++d) materialize(d);
+	for (int r=0; r<num_locals; ++r)
+	{
+		if (!pending_null[r]) continue;
+		emit(new CLIInstruction(OP_RMOVE, r, constant(CLValue()), 0));
+		pending_null[r] = false;
+	}
+}
+
+// local = operand
+void CLRegTranslator::setLocal(int local, int operand)
+{
+	// stack entries still referring to the old value
+	for (size_t d=0; d<vstack.size(); ++d)
+	{
+		if (vstack[d] == local) materialize(d);
+	}
+	pending_null[local] = false;
+	if (operand == local) return;
+
+	// null (declarations without initializer) is assigned lazily
+	if (operand >= CL_RK_CONSTANT && constants[operand - CL_RK_CONSTANT].type() == CL_NULL)
+	{
+		pending_null[local] = true;
+		return;
+	}
+
+	// let the instruction which computed the value write the local directly
+	if (operand >= num_locals && operand < CL_RK_CONSTANT && last_def != -1 && rcode[last_def]->a == operand)
+	{
+		rcode[last_def]->a = local;
+		for (size_t d=0; d<vstack.size(); ++d)
+		{
+			if (vstack[d] == operand) vstack[d] = local;
+		}
+		return;
+	}
+
+	emit(new CLIInstruction(OP_RMOVE, local, operand, 0));
+}
+
+void CLRegTranslator::translateInstruction(size_t i)
+{
+	CLIInstruction *iinst = icode[i];
+	int d = static_cast<int>(vstack.size());
+
+	switch (iinst->op)
+	{
+		case OP_NOP: break;
+
+		// constants and locals are not loaded, but used directly as operands
+		case OP_PUSH0: push(constant(CLValue())); break;
+		case OP_PUSHI: push(constant(CLValue(iinst->arg))); break;
+		case OP_PUSHF: push(constant(CLValue(iinst->arg_float))); break;
+		case OP_PUSHCONST:
+			if (CL_RK_CONSTANT + iinst->arg > 0xffff) failed = true;
+			push(CL_RK_CONSTANT + iinst->arg);
+			break;
+		case OP_PUSHL: push(pending_null[iinst->arg] ? constant(CLValue()) : iinst->arg); break;
+		case OP_DUP: push(vstack[d-1-iinst->arg]); break;
+		case OP_POP: vstack.resize(d - iinst->arg); break;
+		case OP_POPL: setLocal(iinst->arg, pop()); break;
+
+		case OP_CLEARL:
+			for (int r=iinst->arg; r<num_locals; ++r) setLocal(r, constant(CLValue()));
+			break;
+
+		case OP_PUSHSELF: emit(new CLIInstruction(OP_RSELF, stackReg(d), 0, 0)); push(stackReg(d)); break;
+		case OP_PUSHROOT: emit(new CLIInstruction(OP_RROOT, stackReg(d), 0, 0)); push(stackReg(d)); break;
+		case OP_NEWTABLE: emit(new CLIInstruction(OP_RNEWTABLE, stackReg(d), 0, 0)); push(stackReg(d)); break;
+		case OP_NEWARRAY: emit(new CLIInstruction(OP_RNEWARRAY, stackReg(d), 0, 0)); push(stackReg(d)); break;
+
+		case OP_TABGET:
+		case OP_TABGET2:
+		{
+			int k = pop(), t = pop();
+			emit(new CLIInstruction(iinst->op == OP_TABGET ? OP_RTABGET : OP_RTABGET2, stackReg(d-2), t, k));
+			push(stackReg(d-2));
+			if (iinst->op == OP_TABGET2) push(stackReg(d-1));
+			break;
+		}
+		case OP_TABSET:
+		{
+			int v = pop(), k = pop(), t = pop();
+			if (t >= CL_RK_CONSTANT)
+			{
+				emit(new CLIInstruction(OP_RMOVE, stackReg(d-3), t, 0));
+				t = stackReg(d-3);
+			}
+			emit(new CLIInstruction(OP_RTABSET, t, k, v));
+
+			// the value is left on the stack, but usually dropped right away
+			bool dropped = i+1 < icode.size() && !labels[i+1] && icode[i+1]->op == OP_POP && icode[i+1]->arg > 0;
+			if (!dropped && v >= stackReg(d-3) && v < CL_RK_CONSTANT && v != stackReg(d-3))
+			{
+				emit(new CLIInstruction(OP_RMOVE, stackReg(d-3), v, 0));
+				v = stackReg(d-3);
+			}
+			push(v);
+			break;
+		}
+		case OP_TABIT:
+		{
+			int t = pop();
+			if (t != stackReg(d-1)) emit(new CLIInstruction(OP_RMOVE, stackReg(d-1), t, 0));
+			emit(new CLIInstruction(OP_RTABIT, stackReg(d-1), 0, 0));
+			push(stackReg(d-1)); push(stackReg(d));
+			break;
+		}
+		case OP_TABNEXT:
+			materialize(d-2); materialize(d-1);
+			vstack.resize(d-2);
+			emit(new CLIInstruction(OP_RTABNEXT, stackReg(d-2), 0, 0));
+			for (int r=d-2; r<d+2; ++r) push(stackReg(r));
+			break;
+
+		case OP_GETGLOBAL: emit(new CLIInstruction(OP_RGETGLOBAL, stackReg(d), 0, iinst->arg)); push(stackReg(d)); break;
+		case OP_SETGLOBAL: emit(new CLIInstruction(OP_RSETGLOBAL, 0, pop(), iinst->arg)); break;
+
+		case OP_CLONE: { int v = pop(); emit(new CLIInstruction(OP_RCLONE, stackReg(d-1), v, 0)); push(stackReg(d-1)); break; }
+		case OP_NEG: { int v = pop(); emit(new CLIInstruction(OP_RNEG, stackReg(d-1), v, 0)); push(stackReg(d-1)); break; }
+		case OP_NOT: { int v = pop(); emit(new CLIInstruction(OP_RNOT, stackReg(d-1), v, 0)); push(stackReg(d-1)); break; }
+
+		case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MODULO:
+		case OP_BITOR: case OP_BITAND: case OP_BITXOR: case OP_SHL: case OP_SHR:
+		case OP_AND: case OP_OR:
+		case OP_EQ: case OP_NEQ: case OP_LT: case OP_GT: case OP_LE: case OP_GE:
+		{
+			CLOpcode rop = OP_NOP;
+			switch (iinst->op)
+			{
+				case OP_ADD: rop = OP_RADD; break;
+				case OP_SUB: rop = OP_RSUB; break;
+				case OP_MUL: rop = OP_RMUL; break;
+				case OP_DIV: rop = OP_RDIV; break;
+				case OP_MODULO: rop = OP_RMODULO; break;
+				case OP_BITOR: rop = OP_RBITOR; break;
+				case OP_BITAND: rop = OP_RBITAND; break;
+				case OP_BITXOR: rop = OP_RBITXOR; break;
+				case OP_SHL: rop = OP_RSHL; break;
+				case OP_SHR: rop = OP_RSHR; break;
+				case OP_AND: rop = OP_RAND; break;
+				case OP_OR: rop = OP_ROR; break;
+				case OP_EQ: rop = OP_REQ; break;
+				case OP_NEQ: rop = OP_RNEQ; break;
+				case OP_LT: rop = OP_RLT; break;
+				case OP_GT: rop = OP_RGT; break;
+				case OP_LE: rop = OP_RLE; break;
+				case OP_GE: rop = OP_RGE; break;
+				default: assert(0);
+			}
+			int y = pop(), x = pop();
+			emit(new CLIInstruction(rop, stackReg(d-2), x, y));
+			push(stackReg(d-2));
+			break;
+		}
+
+		case OP_MCALL:
+		case OP_TAILCALL:
+		{
+			int argc = icode[i-1]->arg;
+			pop(); // argc
+			int base = d-1 - (argc+2);
+			for (int r=base; r<d-1; ++r) materialize(r);
+			vstack.resize(base);
+			emit(new CLIInstruction(iinst->op == OP_MCALL ? OP_RCALL : OP_RTAILCALL, stackReg(base), 0, argc));
+			push(stackReg(base));
+			break;
+		}
+
+		case OP_RET: emit(new CLIInstruction(OP_RRET, 0, pop(), 0)); break;
+		case OP_YIELD: emit(new CLIInstruction(OP_RYIELD, 0, pop(), 0)); break;
+
+		case OP_JMP:
+			flush();
+			emit(new CLIInstruction(OP_JMP));
+			rcode.back()->jump_target = iinst->jump_target;
+			break;
+
+		case OP_JMPT:
+		case OP_JMPF:
+		{
+			int c = pop();
+			flush();
+			if (c >= CL_RK_CONSTANT)
+			{
+				// constant condition: unconditional jump or nothing
+				if (constants[c - CL_RK_CONSTANT].isTrue() != (iinst->op == OP_JMPT)) break;
+				emit(new CLIInstruction(OP_JMP));
+			}
+			else emit(new CLIInstruction(iinst->op == OP_JMPT ? OP_RJMPT : OP_RJMPF, 0, c, 0));
+			rcode.back()->jump_target = iinst->jump_target;
+			break;
+		}
+
+		case OP_EQJMPF: case OP_NEQJMPF: case OP_LTJMPF: case OP_GTJMPF: case OP_LEJMPF: case OP_GEJMPF:
+		{
+			CLOpcode rop = OP_NOP;
+			switch (iinst->op)
+			{
+				case OP_EQJMPF: rop = OP_REQJMPF; break;
+				case OP_NEQJMPF: rop = OP_RNEQJMPF; break;
+				case OP_LTJMPF: rop = OP_RLTJMPF; break;
+				case OP_GTJMPF: rop = OP_RGTJMPF; break;
+				case OP_LEJMPF: rop = OP_RLEJMPF; break;
+				case OP_GEJMPF: rop = OP_RGEJMPF; break;
+				default: assert(0);
+			}
+			int y = pop(), x = pop();
+			flush();
+			if (x >= CL_RK_CONSTANT)
+			{
+				// the first operand must be a register
+				emit(new CLIInstruction(OP_RMOVE, stackReg(d-2), x, 0));
+				x = stackReg(d-2);
+			}
+			emit(new CLIInstruction(rop, x, y, 0));
+			rcode.back()->jump_target = iinst->jump_target;
+			break;
+		}
+
+		case OP_SWITCH:
+			flush();
+			emit(new CLIInstruction(OP_RSWITCH, 0, vstack.back(), 0));
+			rcode.back()->jump_target = iinst->jump_target;
+			rcode.back()->case_labels = iinst->case_labels;
+			rcode.back()->case_targets = iinst->case_targets;
+			break;
+
+		case OP_LINE: emit(new CLIInstruction(OP_LINE, iinst->arg)); break;
+
+		default: failed = true; break;
+	}
+}
+
+bool CLRegTranslator::translate()
+{
+	size_t old_constants = constants.size();
+	if (!analyze()) return false;
+
+	size_t n = icode.size();
+	std::vector<int> label_pos(n, -1); // position of labels in rcode
+
+	pending_null.assign(num_locals, false);
+	bool live = false; // does control flow reach the current position?
+	for (size_t i=0; i<n && !failed; ++i)
+	{
+		if (states[i].depth == -1) continue; // unreachable
+		if (!live && !labels[i] && i != 0) continue; // only reachable through a folded constant condition
+
+		if (labels[i] || i == 0)
+		{
+			// registers hold the whole operand stack at jump targets
+			if (live) flush();
+			vstack.clear();
+			for (int d=0; d<states[i].depth; ++d) push(stackReg(d));
+			label_pos[i] = static_cast<int>(rcode.size());
+			last_def = -1;
+			live = true;
+		}
+
+		size_t emitted = rcode.size();
+		translateInstruction(i);
+		if (rcode.size() > emitted && (rcode.back()->op == OP_JMP || rcode.back()->op == OP_RRET || rcode.back()->op == OP_RSWITCH
+			|| rcode.back()->op == OP_RTAILCALL)) live = false;
+	}
+
+	// resolve jump targets
+	for (size_t i=0; i<rcode.size() && !failed; ++i)
+	{
+		if (!rcode[i]->jump_target) continue;
+		int pos = label_pos[rcode[i]->jump_target->ip];
+		if (pos < 0 || pos >= static_cast<int>(rcode.size())) failed = true;
+		else rcode[i]->jump_target = rcode[pos];
+
+		std::vector<CLIInstruction*> &case_targets = rcode[i]->case_targets;
+		for (size_t j=0; j<case_targets.size() && !failed; ++j)
+		{
+			pos = label_pos[case_targets[j]->ip];
+			if (pos < 0 || pos >= static_cast<int>(rcode.size())) failed = true;
+			else case_targets[j] = rcode[pos];
+		}
+	}
+
+	if (failed)
+	{
+		constants.resize(old_constants);
+		return false;
+	}
+
+	for (size_t i=0; i<n; ++i) delete icode[i];
+	icode.swap(rcode);
+	rcode.clear();
+	return true;
+}
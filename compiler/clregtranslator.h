@@ -0,0 +1,87 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CLREGTRANSLATOR_H
+#define CLREGTRANSLATOR_H
+
+#include "compiler/cliinstruction.h"
+
+#include "value/clvalue.h"
+
+#include <vector>
+
+// Translates the intermediate stack code of a function into register code (see CLCodeType).
+//
+// Registers 0..num_locals-1 hold the local variables (same numbering as the stack code), the
+// operand stack entry at depth d lives in register num_locals+d. Pushes of locals and constants
+// are not emitted, but kept as pending operands on a compile time stack, so that e.g.
+// "pushl b, pushl c, add, dup 0, popl a, pop 1" becomes "radd a, b, c".
+class CLRegTranslator
+{
+public:
+	CLRegTranslator(std::vector<CLIInstruction*> &icode, std::vector<CLValue> &constants, int num_args, int num_locals);
+	~CLRegTranslator();
+
+	// Replace 'icode' by register code. Returns false (and leaves 'icode' untouched) if the
+	// function can't be translated, e.g. because it needs more than CL_MAX_REGISTERS registers.
+	bool translate();
+
+	int getNumRegisters() { return num_registers; }
+
+private:
+	std::vector<CLIInstruction*> &icode;
+	std::vector<CLValue> &constants;
+	int num_args;
+	int num_locals;    // number of local variable registers (= first operand stack register)
+	int num_registers;
+	bool failed;
+
+	// stack effect analysis
+	struct State
+	{
+		int depth; // operand stack depth, -1: instruction is unreachable
+	};
+	std::vector<State> states; // state on entry of each instruction
+	std::vector<bool> labels;  // instruction is a jump target
+
+	bool stackEffect(size_t i, int &pop, int &push);
+	bool analyze();
+
+	// code generation
+	std::vector<CLIInstruction*> rcode; // generated register code
+	std::vector<int> vstack;            // operand of each operand stack entry (register or constant)
+	std::vector<bool> pending_null;     // local registers which are still to be set to null
+	int last_def;                       // index of the last instruction in rcode if its destination may be retargeted, or -1
+
+	inline int stackReg(int depth) { return num_locals + depth; }
+	int constant(const CLValue &v);
+
+	void emit(CLIInstruction *rinst);
+	void push(int operand) { vstack.push_back(operand); }
+	int pop() { int operand = vstack.back(); vstack.pop_back(); return operand; }
+
+	void materialize(int depth); // move operand stack entry into its register
+	void flush();                // materialize whole operand stack, null pending locals
+	void setLocal(int local, int operand);
+	void translateInstruction(size_t i);
+};
+
+#endif
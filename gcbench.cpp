@@ -0,0 +1,140 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+// Garbage collector stress benchmark.
+//
+// Builds heaps of growing size (timing the script allocating them), half of them reachable from
+// global arrays and half garbage. Each heap is collected twice: first stop-the-world (unmark, mark,
+// sweep, free), where the per-object cost of the sweep should stay flat as the heap grows, then
+// incrementally in steps of the default budget, where the longest step (pause) should not grow with
+// the heap. Finally the heap is promoted to the old generation and a minor collection is timed
+// after allocating a nursery of temporaries, which should not depend on the heap size at all.
+
+#include "cl2.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <ctime>
+
+using namespace std;
+
+// keep 'n' small tables alive in global 'keep' (in arrays of 1000), and drop 'n' others
+static void buildHeap(CLContext &context, int n)
+{
+	std::ostringstream src;
+	src << "local i, b; keep = array[];"
+	    << "for (i = 0; i < " << n << "; i = i + 1) {"
+	    << "	if (i % 1000 == 0) { b = array[]; keep[i / 1000] = b; }"
+	    << "	b[i % 1000] = [v = i]; local tmp = [w = i];"
+	    << "}";
+
+	std::istringstream input(src.str());
+	CLValue thr(new CLThread());
+	GET_THREAD(thr)->init(CLCompiler::compile(input));
+	while (GET_THREAD(thr)->isRunning()) GET_THREAD(thr)->run();
+}
+
+// allocate 'n' temporary tables and strings, keep every 100th in global 'young'
+static void buildNursery(CLContext &context, int n)
+{
+	std::ostringstream src;
+	src << "local i; young = array[];"
+	    << "for (i = 0; i < " << n << "; i = i + 1) {"
+	    << "	local tmp = [s = \"t\".concat(\"mp\")]; if (i % 100 == 0) young[i / 100] = tmp;"
+	    << "}";
+
+	std::istringstream input(src.str());
+	CLValue thr(new CLThread());
+	GET_THREAD(thr)->init(CLCompiler::compile(input));
+	while (GET_THREAD(thr)->isRunning()) GET_THREAD(thr)->run();
+}
+
+static double seconds(clock_t start, clock_t end)
+{
+	return double(end - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **args)
+{
+	int max_size = argc > 1 ? atoi(args[1]) : 800000;
+	if (max_size < 1000) max_size = 1000;
+
+	try
+	{
+		CLContext context;
+
+		cout << setw(10) << "objects" << setw(12) << "build" << setw(12) << "mark" << setw(12) << "sweep" << setw(12) << "free" 
+		     << setw(16) << "sweep ns/obj" << setw(10) << "steps" << setw(14) << "max step" << setw(12) << "minor" << endl;
+
+		for (int n = max_size / 8; n <= max_size; n *= 2)
+		{
+			clock_t b0 = clock();
+			buildHeap(context, n);
+
+			clock_t t0 = clock();
+			context.unmarkObjects();
+			context.markObjects();
+			clock_t t1 = clock();
+			context.sweepObjects();
+			clock_t t2 = clock();
+			context.freeFinalized();
+			clock_t t3 = clock();
+
+			// incremental: the garbage of a second heap, collected step by step
+			buildHeap(context, n);
+			int steps = 0;
+			double max_step = 0.0;
+			bool done = false;
+			while (!done)
+			{
+				clock_t s0 = clock();
+				done = context.collectStep();
+				clock_t s1 = clock();
+				if (seconds(s0, s1) > max_step) max_step = seconds(s0, s1);
+				++steps;
+			}
+
+			// minor: a nursery of temporaries on top of the (now old) heap
+			buildHeap(context, n);
+			context.unmarkObjects();
+			context.markObjects();
+			context.sweepObjects();
+			context.freeFinalized();
+			buildNursery(context, 20000);
+			clock_t m0 = clock();
+			context.collectYoung();
+			clock_t m1 = clock();
+
+			cout << setw(10) << 2 * n << fixed << setprecision(4) 
+			     << setw(12) << seconds(b0, t0) << setw(12) << seconds(t0, t1) << setw(12) << seconds(t1, t2) << setw(12) << seconds(t2, t3)
+			     << setw(16) << setprecision(1) << seconds(t1, t2) * 1e9 / (2 * n)
+			     << setw(10) << steps << setw(14) << setprecision(5) << max_step << setw(12) << seconds(m0, m1) << endl;
+
+			context.clear();
+		}
+
+	} catch (CLParserException err) {
+		cout << err.what() << endl;
+	} catch (std::runtime_error err) {
+		cout << err.what() << endl;
+	}
+}
@@ -40,6 +40,7 @@ public:
 	virtual void IO(char &value) = 0;
 	virtual void IO(std::string &value) = 0;
 	virtual void IO(float &value) = 0;
+	virtual void IO(double &value) = 0;
 	virtual void IO(bool &value) = 0;
 	//virtual void IO(size_t &value) = 0;
 
@@ -60,6 +60,11 @@ void CLSerialLoader::IO(float &value)
 	input.read((char*)&value, sizeof(float));
 }
 
+void CLSerialLoader::IO(double &value)
+{
+	input.read((char*)&value, sizeof(double));
+}
+
 void CLSerialLoader::IO(bool &value)
 {
 	char tmp; IO(tmp);
@@ -55,6 +55,11 @@ void CLSerialSaver::IO(float &value)
 	output.write((char*)&value, sizeof(float));
 }
 
+void CLSerialSaver::IO(double &value)
+{
+	output.write((char*)&value, sizeof(double));
+}
+
 void CLSerialSaver::IO(bool &value)
 {
 	char tmp = (value ? 1 : 0);
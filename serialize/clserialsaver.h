@@ -37,6 +37,7 @@ public:
 	void IO(int &value);
 	void IO(char &value);
 	void IO(float &value);
+	void IO(double &value);
 	void IO(std::string &value);
 	void IO(bool &value);
 	//void IO(size_t &value);
@@ -38,10 +38,18 @@ int main(char argc, char **args)
 
 		context.addModule(&math);
 
-		const char *file = argc > 1 ? args[1] : 0;
+		// -d: dump code listings before/after peephole optimization
+		int argi = 1;
+		if (argc > argi && std::string(args[argi]) == "-d")
+		{
+			CLPeephole::dump = true;
+			++argi;
+		}
+
+		const char *file = argc > argi ? args[argi] : 0;
 		if (file == 0)
 		{
-			cout << "Syntax: " << args[0] << " scriptfile" << endl;
+			cout << "Syntax: " << args[0] << " [-d] scriptfile" << endl;
 			exit(1);
 		}
 
@@ -54,10 +62,6 @@ int main(char argc, char **args)
 		while (context.countRunningThreads())
 		{
 			context.roundRobin();
-			context.unmarkObjects();
-			context.markObjects();
-			context.sweepObjects();
-			context.freeFinalized();
 		}
 
 		context.clear();
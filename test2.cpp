@@ -50,10 +50,6 @@ int main(char argc, char **args)
 		for (int i=0; i<1000; ++i)
 		{
 			context.roundRobin();
-			context.unmarkObjects();
-			context.markObjects();
-			context.sweepObjects();
-			context.freeFinalized();
 		}
 
 		ofstream outputfile("dump.bin");
@@ -68,10 +64,6 @@ int main(char argc, char **args)
 		while (context.countRunningThreads() > 0)
 		{
 			context.roundRobin();
-			context.unmarkObjects();
-			context.markObjects();
-			context.sweepObjects();
-			context.freeFinalized();
 		}
 #endif
 
@@ -0,0 +1,88 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+// Minor collections after a stop-the-world major collection.
+//
+// Objects allocated during a manual major collection (between unmarkObjects() and markObjects())
+// survive it, and the following minor collections must neither free them nor the objects they
+// reference. Prints "OK" or the failed check, and returns 1 on failure.
+
+#include "cl2.h"
+
+#include <iostream>
+
+using namespace std;
+
+static int failed = 0;
+
+static void check(bool ok, const char *what)
+{
+	if (ok) return;
+	cout << "FAILED: " << what << endl;
+	failed = 1;
+}
+
+int main()
+{
+	try
+	{
+		CLContext context;
+		context.setGCManual(true);
+		context.collectGarbage();
+		int base = context.countObjects();
+
+		// manual major collection, a table is stored in the root table while it is in progress
+		context.unmarkObjects();
+		CLValue key(new CLString("kept"));
+		CLValue kept(new CLTable());
+		context.getRootTable().set(key, kept);
+		context.markObjects();
+		context.sweepObjects();
+		context.freeFinalized();
+		check(context.countObjects() == base + 2, "major collection keeps the new table and its key");
+		check(context.countYoungObjects() == 0, "major collection leaves no young objects");
+
+		context.collectGarbage(CL_GC_MINOR);
+		check(context.countObjects() == base + 2, "minor collection keeps the surviving objects");
+
+		// young objects referenced by the surviving table live on as well
+		CLValue inner(new CLTable());
+		kept.set(key, inner);
+		context.collectGarbage(CL_GC_MINOR);
+		context.collectGarbage(CL_GC_MINOR);
+		context.collectGarbage(CL_GC_MINOR);
+		check(context.countObjects() == base + 3, "minor collections keep objects referenced by old ones");
+		check(context.getRootTable().get(key).get(key).isEqual(inner), "surviving objects are intact");
+
+		// and garbage is still collected
+		context.getRootTable().set(key, CLValue());
+		key.setNull(); kept.setNull(); inner.setNull();
+		context.collectGarbage();
+		check(context.countObjects() == base, "major collection frees the garbage");
+
+	} catch (std::runtime_error err) {
+		cout << err.what() << endl;
+		failed = 1;
+	}
+
+	if (!failed) cout << "OK" << endl;
+	return failed;
+}
@@ -0,0 +1,84 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+// Host roots.
+//
+// Values the host keeps between collections survive them while they are added as roots
+// (CLContext::addRoot), in major, incremental and minor collections. Prints "OK" or the failed
+// check, and returns 1 on failure.
+
+#include "cl2.h"
+
+#include <iostream>
+
+using namespace std;
+
+static int failed = 0;
+
+static void check(bool ok, const char *what)
+{
+	if (ok) return;
+	cout << "FAILED: " << what << endl;
+	failed = 1;
+}
+
+int main()
+{
+	try
+	{
+		CLContext context;
+		context.setGCManual(true);
+		context.collectGarbage();
+		int base = context.countObjects();
+
+		// a table built by the host, referencing a string
+		CLValue key(new CLString("key"));
+		CLValue table(new CLTable());
+		table.set(key, key);
+		context.addRoot(table);
+		key.setNull();
+
+		context.collectGarbage(CL_GC_MINOR);
+		check(context.countObjects() == base + 2, "minor collection keeps a root and its references");
+		context.collectGarbage();
+		check(context.countObjects() == base + 2, "major collection keeps a root and its references");
+		while (!context.collectStep(10)) {}
+		check(context.countObjects() == base + 2, "incremental collection keeps a root and its references");
+
+		// roots are counted
+		context.addRoot(table);
+		context.removeRoot(table);
+		context.collectGarbage();
+		check(context.countObjects() == base + 2, "root added twice survives one removeRoot()");
+
+		context.removeRoot(table);
+		table.setNull();
+		context.collectGarbage();
+		check(context.countObjects() == base, "removed root is collected");
+
+	} catch (std::runtime_error err) {
+		cout << err.what() << endl;
+		failed = 1;
+	}
+
+	if (!failed) cout << "OK" << endl;
+	return failed;
+}
@@ -29,7 +29,7 @@
 
 void CLArray::set(CLValue &key, CLValue &val)
 {
-	if (key.type != CL_INTEGER) return;
+	if (key.type() != CL_INTEGER) return;
 
 	int idx = GET_INTEGER(key);
 	if (idx < 0) return;	// TODO
@@ -37,11 +37,12 @@ void CLArray::set(CLValue &key, CLValue &val)
 	if (idx >= static_cast<int>(array.size())) array.resize(idx+1);
 
 	array[idx] = val;
+	gc_barrier();
 }
 
 bool CLArray::get(CLValue &key, CLValue &val)
 {
-	switch (key.type)
+	switch (key.type())
 	{
 		case CL_INTEGER:
 		{
@@ -133,16 +134,14 @@ void CLArray::save(class CLSerializer &S, CLArray *O)
 }
 
 // GC
-void CLArray::gc_mark()
+int CLArray::gc_traverse()
 {
-	if (gc_isMarked()) return;
-
-	gc_setMarked();
-
 	size_t size = array.size();
 	for (size_t i=0; i<size; ++i)
 	{
 		array[i].markObject();
 	}
+
+	return 1 + size;
 }
 
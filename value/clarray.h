@@ -53,7 +53,7 @@ private:
 	std::vector<CLValue> array;
 
 	// GC
-	virtual void gc_mark();
+	virtual int gc_traverse();
 };
 
 #endif
@@ -25,20 +25,29 @@
 #include "serialize/clserializer.h"
 
 CLExternalFunction::CLExternalFunction(const std::string &func_id)
-	: func_id(func_id), cache_funcptr(0)
+	: func_id(func_id), resolved(false), cache_funcptr(0), cache_native(0)
 {
 }
 
-CLExternalFunctionPtr CLExternalFunction::getExternalFunctionPtr()
+void CLExternalFunction::resolve()
 {
-	if (cache_funcptr == 0)
-	{
-		cache_funcptr = CLContext::inst().getExternalFunctionPtr(func_id);
-	}
+	cache_native = CLContext::inst().getNativeFunctionPtr(func_id);
+	cache_funcptr = CLContext::inst().getExternalFunctionPtr(func_id);
+	resolved = (cache_native != 0) || (cache_funcptr != 0);
+}
 
+CLExternalFunctionPtr CLExternalFunction::getExternalFunctionPtr()
+{
+	if (!resolved) resolve();
 	return cache_funcptr;
 }
 
+CLNativeFunctionPtr CLExternalFunction::getNativeFunctionPtr()
+{
+	if (!resolved) resolve();
+	return cache_native;
+}
+
 //static member
 CLExternalFunction *CLExternalFunction::load(class CLSerializer &S)
 {
@@ -34,6 +34,7 @@ public:
 	CLExternalFunction(const std::string &func_id);
 
 	CLExternalFunctionPtr getExternalFunctionPtr();
+	CLNativeFunctionPtr getNativeFunctionPtr();
 
 	const std::string &getFuncID() { return func_id; }
 
@@ -50,7 +51,10 @@ public:
 private:
 	std::string func_id;
 
+	void resolve();
+	bool resolved;
 	CLExternalFunctionPtr cache_funcptr;
+	CLNativeFunctionPtr cache_native;
 };
 
 #endif
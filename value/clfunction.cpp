@@ -21,16 +21,98 @@
 
 #include "value/clfunction.h"
 #include "value/clvalue.h"
+#include "value/clstring.h"
 
 #include "serialize/clserializer.h"
+#include "vm/clverifier.h"
 
 #include <sstream>
+#include <algorithm>
+#include <stdexcept>
 
 #include <iostream>
 using namespace std;
 
+// string case labels are stored in a hash table with at least twice as many buckets
+void CLSwitchTable::addCase(CLValue label, int target)
+{
+	if (type == CL_INTEGER)
+	{
+		// offsets from min are computed unsigned, the labels may be far apart
+		int value = GET_INTEGER(label);
+		if (targets.empty())
+		{
+			min = value;
+		} else if (value < min) {
+			targets.insert(targets.begin(), unsigned(min) - unsigned(value), -1);
+			min = value;
+		}
+		size_t i = unsigned(value) - unsigned(min);
+		if (i >= targets.size()) targets.resize(i + 1, -1);
+		if (targets[i] == -1) targets[i] = target;
+		return;
+	}
+
+	if (keys.empty() || 2 * (keys.size() - std::count(targets.begin(), targets.end(), -1) + 1) > keys.size())
+	{
+		// rehash
+		std::vector<CLValue> old_keys(keys);
+		std::vector<int> old_targets(targets);
+		size_t size = keys.empty() ? 8 : 2 * keys.size();
+		keys.assign(size, CLValue::Null());
+		targets.assign(size, -1);
+		for (size_t i=0; i<old_keys.size(); ++i)
+		{
+			if (old_targets[i] != -1) addCase(old_keys[i], old_targets[i]);
+		}
+	}
+
+	CLString *s = GET_STRING(label);
+	size_t mask = keys.size() - 1;
+	size_t i = s->hash() & mask;
+	for (; targets[i] != -1; i = (i+1) & mask)
+	{
+		if (GET_STRING(keys[i])->get() == s->get()) return; // duplicate
+	}
+	keys[i] = label;
+	targets[i] = target;
+}
+
+int CLSwitchTable::lookup(CLValue &v)
+{
+	if (type == CL_INTEGER)
+	{
+		// floats match integer labels of the same value, as with ==
+		int value;
+		if (v.type() == CL_INTEGER)
+		{
+			value = GET_INTEGER(v);
+		} else if (v.type() == CL_FLOAT && GET_FLOAT(v) >= double(min) && GET_FLOAT(v) < double(min) + double(targets.size())) {
+			value = int(GET_FLOAT(v));
+			if (double(value) != GET_FLOAT(v)) return default_target;
+		} else {
+			return default_target;
+		}
+
+		unsigned int i = unsigned(value) - unsigned(min);
+		if (i < targets.size() && targets[i] != -1) return targets[i];
+		return default_target;
+	}
+
+	if (v.type() == CL_STRING && !keys.empty())
+	{
+		CLString *s = GET_STRING(v);
+		size_t mask = keys.size() - 1;
+		for (size_t i = s->hash() & mask; targets[i] != -1; i = (i+1) & mask)
+		{
+			if (GET_OBJECT(keys[i]) == GET_OBJECT(v) || GET_STRING(keys[i])->get() == s->get()) return targets[i];
+		}
+	}
+	return default_target;
+}
+
 CLFunction::CLFunction()
-	: num_args(0)
+	: num_args(0), frame_size(0), max_stack(0), line_starts_valid(false)
 {
 }
 
@@ -38,11 +120,132 @@ CLFunction::~CLFunction()
 {
 }
 
+static void encodeVarint(std::vector<unsigned char> &out, unsigned int v)
+{
+	while (v >= 0x80)
+	{
+		out.push_back((unsigned char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((unsigned char)v);
+}
+
+static unsigned int decodeVarint(const std::vector<unsigned char> &in, size_t &pos)
+{
+	unsigned int v = 0;
+	for (int shift = 0; pos < in.size(); shift += 7)
+	{
+		unsigned char c = in[pos++];
+		v |= (unsigned int)(c & 0x7f) << shift;
+		if (!(c & 0x80)) break;
+	}
+	return v;
+}
+
+void CLFunction::setLines(const std::vector<std::pair<int, int> > &lines)
+{
+	this->lines.clear();
+	line_starts.clear();
+	line_starts_valid = false;
+
+	int ip = 0, line = 0;
+	for (size_t i=0; i<lines.size(); ++i)
+	{
+		int dline = lines[i].second - line;
+		encodeVarint(this->lines, lines[i].first - ip);
+		encodeVarint(this->lines, (unsigned(dline) << 1) ^ unsigned(dline >> 31));
+		ip = lines[i].first;
+		line = lines[i].second;
+	}
+}
+
+// instructions with an inline cache
+static bool usesCache(int op)
+{
+	switch (op)
+	{
+		case OP_TABGET: case OP_TABGET2: case OP_TABSET: case OP_TABPUT: case OP_GETGLOBAL: case OP_SETGLOBAL:
+		case OP_RTABGET: case OP_RTABGET2: case OP_RTABSET: case OP_RGETGLOBAL: case OP_RSETGLOBAL:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void CLFunction::initCaches()
+{
+	cache_index.assign(code.size(), 0);
+	size_t count = 0;
+	for (size_t ip=0; ip<code.size(); ++ip)
+	{
+		if (!usesCache(code[ip].op)) continue;
+		cache_index[ip] = static_cast<unsigned short>(std::min<size_t>(count, 0xffff));
+		++count;
+	}
+	caches.assign(std::min<size_t>(count, 0x10000), CLTableCache());
+}
+
+int CLFunction::getLine(unsigned int ip)
+{
+	if (ip >= code.size()) return -1;
+
+	// the entries are sorted by ip, the last one at or before 'ip' holds its line
+	size_t pos = 0;
+	unsigned int entry_ip = 0;
+	int line = 0, result = -1; // no line before the first entry
+	while (pos < lines.size())
+	{
+		entry_ip += decodeVarint(lines, pos);
+		unsigned int dline = decodeVarint(lines, pos);
+		if (entry_ip > ip) break;
+		line += (int)(dline >> 1) ^ -(int)(dline & 1);
+		result = line;
+	}
+	return result;
+}
+
+void CLFunction::decodeLineStarts()
+{
+	line_starts.clear();
+
+	// (ip, line) of every entry
+	std::vector<std::pair<unsigned int, int> > entries;
+	size_t pos = 0;
+	unsigned int ip = 0;
+	int line = 0;
+	while (pos < lines.size())
+	{
+		ip += decodeVarint(lines, pos);
+		unsigned int dline = decodeVarint(lines, pos);
+		line += (int)(dline >> 1) ^ -(int)(dline & 1);
+		entries.push_back(std::make_pair(ip, line));
+	}
+
+	// of several entries at the same ip the last one holds, a line starts where it differs from the
+	// line of the instructions before
+	int prev = -1;
+	for (size_t i=0; i<entries.size(); ++i)
+	{
+		if (i+1 < entries.size() && entries[i+1].first == entries[i].first) continue;
+		if (entries[i].first >= code.size()) break;
+		if (entries[i].second != -1 && entries[i].second != prev) line_starts.push_back(entries[i].first);
+		prev = entries[i].second;
+	}
+	line_starts_valid = true;
+}
+
+bool CLFunction::isLineStart(unsigned int ip)
+{
+	if (!line_starts_valid) decodeLineStarts();
+	return std::binary_search(line_starts.begin(), line_starts.end(), ip);
+}
+
 //static member
 void CLFunction::save(CLSerializer &S, CLFunction *O)
 {
-	// write number of arguments
+	// write number of arguments, frame size
 	S.IO(O->num_args);
+	S.IO(O->frame_size);
 	
 	// write code
 	int codesize = O->code.size();
@@ -54,25 +257,47 @@ void CLFunction::save(CLSerializer &S, CLFunction *O)
 		// write opcode
 		char opcode = inst.op;
 		S.IO(opcode);
-		
-		// write argument, if any
-		CLOpcodeDesc desc = getOpcodeDesc(inst.op);
-		switch (desc.arg_type)
+		CLOpcodeDesc desc = getOpcodeDesc(CLOpcode(inst.op));
+
+		// write register operands, if any
+		if (desc.registers)
 		{
-			case ARG_NONE: break;
-			case ARG_INTEGER: S.IO(inst.arg); break;
-			case ARG_FLOAT: S.IO(inst.arg_float); break;
-			case ARG_STRING: S.IO(inst.arg_str); break;
+			char a = inst.a; S.IO(a);
+			unsigned int b = inst.b; S.IO(b);
 		}
+		
+		// write argument (or side table index), if any
+		if (desc.arg_type != ARG_NONE) S.IO(inst.arg);
+	}
+
+	// write side tables
+	int tmp;
+	S.IO(tmp = O->floats.size());
+	for (int i=0; i<tmp; ++i) S.IO(O->floats[i]);
+
+	S.IO(tmp = O->switches.size());
+	for (int i=0; i<tmp; ++i)
+	{
+		CLSwitchTable &T = O->switches[i];
+		int type = T.type; S.IO(type);
+		S.IO(T.min);
+		S.IO(T.default_target);
+		int size = T.targets.size(); S.IO(size);
+		for (int j=0; j<size; ++j) S.IO(T.targets[j]);
+		if (T.type == CL_STRING) for (int j=0; j<size; ++j) CLValue::save(S, T.keys[j]);
 	}
 	
 	// write constants
-	int tmp;
 	S.IO(tmp = O->constants.size());
 	for (int i=0; i<tmp; ++i)
 	{
 		CLValue::save(S, O->constants[i]);
 	}
+
+	// write debug info
+	S.IO(O->file);
+	S.IO(tmp = O->lines.size());
+	for (int i=0; i<tmp; ++i) { char c = O->lines[i]; S.IO(c); }
 }
 
 //static member
@@ -80,12 +305,14 @@ CLFunction *CLFunction::load(CLSerializer &S)
 {
 	CLFunction *f = new CLFunction(); S.addPtr(f);
 
-	// read number of argument
+	// read number of argument, frame size
 	S.IO(f->num_args);
+	S.IO(f->frame_size);
 
 	// read code
 	int codesize;
 	S.IO(codesize);
+	if (codesize < 0) throw std::runtime_error("Invalid function: bad code size");
 	f->code.resize(codesize);
 	for (int i=0; i<codesize; ++i)
 	{
@@ -93,27 +320,62 @@ CLFunction *CLFunction::load(CLSerializer &S)
 
 		// read opcode
 		char opcode;
-		S.IO(opcode); inst.op = CLOpcode(opcode);
+		S.IO(opcode); inst.op = (unsigned char)opcode;
+		if (inst.op >= NUM_OPCODES) throw std::runtime_error("Invalid function: bad opcode");
+		CLOpcodeDesc desc = getOpcodeDesc(CLOpcode(inst.op));
 
-		// load argument, if any
-		CLOpcodeDesc desc = getOpcodeDesc(inst.op);
-		switch (desc.arg_type)
+		// read register operands, if any
+		inst.a = 0; inst.b = 0;
+		if (desc.registers)
 		{
-			case ARG_NONE: break;
-			case ARG_INTEGER: S.IO(inst.arg); break;
-			case ARG_FLOAT: S.IO(inst.arg_float); break;
-			case ARG_STRING: S.IO(inst.arg_str); break;
+			char a; S.IO(a); inst.a = (unsigned char)a;
+			unsigned int b; S.IO(b); inst.b = (unsigned short)b;
 		}
+
+		// load argument (or side table index), if any
+		inst.arg = 0;
+		if (desc.arg_type != ARG_NONE) S.IO(inst.arg);
 	}
 
-	// read constants
+	// read side tables
 	int tmp;
+	S.IO(tmp); if (tmp < 0) throw std::runtime_error("Invalid function: bad side table size");
+	f->floats.resize(tmp);
+	for (int i=0; i<tmp; ++i) S.IO(f->floats[i]);
+
+	S.IO(tmp); if (tmp < 0) throw std::runtime_error("Invalid function: bad side table size");
+	f->switches.resize(tmp);
+	for (int i=0; i<tmp; ++i)
+	{
+		CLSwitchTable &T = f->switches[i];
+		int type; S.IO(type); T.type = CLValueType(type);
+		S.IO(T.min);
+		S.IO(T.default_target);
+		int size; S.IO(size); if (size < 0) throw std::runtime_error("Invalid function: bad side table size");
+		T.targets.resize(size);
+		for (int j=0; j<size; ++j) S.IO(T.targets[j]);
+		if (T.type == CL_STRING) for (int j=0; j<size; ++j) T.keys.push_back(CLValue::load(S));
+	}
+
+	// read constants
 	S.IO(tmp); 
 	for (int i=0; i<tmp; ++i)
 	{
 		f->constants.push_back(CLValue::load(S));
 	}
 
+	// read debug info
+	S.IO(f->file);
+	S.IO(tmp); if (tmp < 0) throw std::runtime_error("Invalid function: bad line table size");
+	f->lines.resize(tmp);
+	for (int i=0; i<tmp; ++i) { char c; S.IO(c); f->lines[i] = (unsigned char)c; }
+
+	f->initCaches();
+
+	// snapshots aren't trusted, the interpreter doesn't check anything the verifier does
+	CLVerifier verifier(f);
+	if (!verifier.verify()) throw std::runtime_error("Invalid function: " + verifier.getError());
+
 	return f;
 }
 
@@ -129,16 +391,23 @@ std::string CLFunction::toString()
 }
 
 // GC
-void CLFunction::gc_mark()
+int CLFunction::gc_traverse()
 {
-	if (gc_isMarked()) return;
-	gc_setMarked();
+	int work = 1;
 
 	size_t size = constants.size();
 	for (size_t i=0; i<size; ++i)
 	{
 		constants[i].markObject();
 	}
+
+	for (size_t i=0; i<switches.size(); ++i)
+	{
+		for (size_t j=0; j<switches[i].keys.size(); ++j) switches[i].keys[j].markObject();
+		work += switches[i].keys.size();
+	}
+
+	return work + size;
 }
 
 
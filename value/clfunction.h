@@ -24,17 +24,36 @@
 
 #include "value/clobject.h"
 #include "value/clvalue.h"
+#include "value/cltable.h"
 #include "clopcode.h"
 
 #include <vector>
 #include <string>
 
+// Packed instruction (8 bytes). Float arguments are stored in the function's side table
+// (CLFunction::floats); 'arg' holds their index then.
 struct CLInstruction
 {
-	CLOpcode op;
-	int arg;
-	float arg_float;
-	std::string arg_str;
+	unsigned char op;  // CLOpcode
+	unsigned char a;   // register operand (register code)
+	unsigned short b;  // register or constant operand (register code)
+	int arg;           // integer argument, jump target, side table index or register/constant operand
+};
+
+// Jump table of a switch statement (OP_SWITCH, OP_RSWITCH). Integer case labels index a dense
+// table, string case labels are looked up in a hash table (linear probing, see CLString::hash).
+struct CLSwitchTable
+{
+	CLSwitchTable() : type(CL_INTEGER), min(0), default_target(0) {}
+
+	CLValueType type;          // type of the case labels: CL_INTEGER or CL_STRING
+	int min;                   // CL_INTEGER: case label of targets[0]
+	std::vector<int> targets;  // CL_INTEGER: jump target of case label min+i, CL_STRING: of keys[i]; -1: none
+	std::vector<CLValue> keys; // CL_STRING: case labels by hash bucket (null: empty), size is a power of 2
+	int default_target;        // jump target if no case label matches
+
+	void addCase(CLValue label, int target); // keeps the first target of duplicate labels
+	int lookup(CLValue &v);
 };
 
 class CLFunction : public CLObject
@@ -43,13 +62,27 @@ public:
 	CLFunction();
 	~CLFunction();
 
-	// load/save
+	// load/save. load() verifies the code, throws a std::runtime_error if it's invalid
 	static CLFunction *load(class CLSerializer &ss);
 	static void save(class CLSerializer &ss, CLFunction *O);
 
 	std::vector<CLInstruction> code;
 	std::vector<CLValue> constants;
+	std::vector<double> floats;       // ARG_FLOAT arguments of 'code'
+	std::vector<CLSwitchTable> switches; // jump tables of OP_SWITCH/OP_RSWITCH
 	int num_args;
+	int frame_size;                   // number of locals allocated on function entry (register code: registers)
+	int max_stack;                    // maximum operand stack depth above the frame (set by CLVerifier, not serialized)
+
+	// inline caches of the table access instructions (see initCaches), not serialized
+	void initCaches();
+	inline CLTableCache &getCache(unsigned int ip) { return caches[cache_index[ip]]; }
+
+	// debug info: source file and line of each instruction
+	std::string file;
+	void setLines(const std::vector<std::pair<int, int> > &lines); // (ip, line) where a line starts, sorted by ip
+	int getLine(unsigned int ip);         // -1: unknown
+	bool isLineStart(unsigned int ip);
 
 	// clone
 	virtual CLValue clone();
@@ -58,8 +91,22 @@ public:
 	virtual std::string toString();
 
 private:
+	// Line table: for every (ip, line) pair the ip and line deltas to the previous one, as
+	// variable length integers (7 bits per byte, the line delta zigzag encoded). getLine()
+	// walks it, isLineStart() searches the ips where a line starts, decoded on first use.
+	std::vector<unsigned char> lines;
+	std::vector<unsigned int> line_starts;
+	bool line_starts_valid;
+	void decodeLineStarts();
+
+	// Inline caches, one per table access instruction in code order, and the index of every
+	// instruction's cache (0 for instructions without one). Instructions beyond the 65536th cache
+	// share the last one, a cache is only used after checking the table's layout.
+	std::vector<CLTableCache> caches;
+	std::vector<unsigned short> cache_index;
+
 	// GC
-	virtual void gc_mark();
+	virtual int gc_traverse();
 };
 
 #endif
@@ -20,18 +20,17 @@
 
 
 #include "value/clstring.h"
-#include "value/clexternalfunction.h"
+#include "vm/clcontext.h"
 #include "serialize/clserializer.h"
 
 CLString::CLString(const char *cstr)
-	: cache_valid(false)
+	: value(cstr), cache_valid(false)
 {
-	set(std::string(cstr));
 }
 
 CLString::CLString(const std::string &str)
+	: value(str), cache_valid(false)
 {
-	set(str);
 }
 
 CLString::~CLString()
@@ -62,7 +61,7 @@ void CLString::set(CLValue &key, CLValue &val)
 
 bool CLString::get(CLValue &key, CLValue &val)
 {
-	switch (key.type)
+	switch (key.type())
 	{
 		case CL_INTEGER:
 		{
@@ -81,19 +80,19 @@ bool CLString::get(CLValue &key, CLValue &val)
 		{
 			const std::string &key_str = GET_STRING(key)->get();
 			if (key_str == "length") {
-				val = CLValue(new CLExternalFunction("sys_string_length"));
+				val = CLContext::inst().getMethod(CL_METHOD_STRING_LENGTH);
 				return true;
 			} else if (key_str == "clone") {
-				val = CLValue(new CLExternalFunction("sys_string_clone"));
+				val = CLContext::inst().getMethod(CL_METHOD_STRING_CLONE);
 				return true;
 			} else if (key_str == "concat") {
-				val = CLValue(new CLExternalFunction("sys_string_concat"));
+				val = CLContext::inst().getMethod(CL_METHOD_STRING_CONCAT);
 				return true;
 			} else if (key_str == "substr") {
-				val = CLValue(new CLExternalFunction("sys_string_substr"));
+				val = CLContext::inst().getMethod(CL_METHOD_STRING_SUBSTR);
 				return true;
 			} else if (key_str == "replace") {
-				val = CLValue(new CLExternalFunction("sys_string_replace"));
+				val = CLContext::inst().getMethod(CL_METHOD_STRING_REPLACE);
 				return true;
 			} else {
 				return false;
@@ -34,7 +34,6 @@ public:
 	~CLString();
 
 	const std::string &get() { return value; }
-	void set(const std::string &str) { cache_valid = false; value = str; }
 
 	unsigned int hash();
 
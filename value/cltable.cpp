@@ -23,10 +23,15 @@
 
 #include "serialize/clserializer.h"
 
+#include "vm/clcontext.h"
+
 #include <assert.h>
+#include <new>
 #include <string>
 #include <sstream>
 
+unsigned long CLTable::next_layout = 0;
+
 CLTable::CLTable() : slots(0), reserved(0)
 {
 	clear();
@@ -34,19 +39,20 @@ CLTable::CLTable() : slots(0), reserved(0)
 
 CLTable::~CLTable()
 {
-	delete [] slots;
+	FreeSlots(slots, size);
 }
 
 void CLTable::clear()
 {
-	delete [] slots;
+	if (slots) FreeSlots(slots, size);
 
 	size = MIN_SIZE;
 	if (size < reserved) size = reserved;
 
 	fill = 0;
-	slots = new Slot[size];
+	slots = AllocSlots(size);
 	free_slot = &slots[size-1];
+	changeLayout();
 }
 
 void CLTable::reserve(size_t reserve_size)
@@ -60,7 +66,7 @@ void CLTable::reserve(size_t reserve_size)
 
 CLTable::HashKey_t CLTable::Hash(CLValue &key)
 {
-	switch (key.type)
+	switch (key.type())
 	{
 		case CL_STRING:  return (HashKey_t)(GET_STRING(key)->hash());
 		case CL_INTEGER: return (HashKey_t)(GET_INTEGER(key));
@@ -92,8 +98,9 @@ void CLTable::Resize(size_t new_size)
 
 	size = new_size;
 	fill = 0;
-	slots = new Slot[size];
+	slots = AllocSlots(size);
 	free_slot = &slots[size-1];
+	changeLayout();
 
 	for (size_t i=0; i<old_size; ++i)
 	{
@@ -103,7 +110,20 @@ void CLTable::Resize(size_t new_size)
 		}
 	}
 
-	delete [] old_slots;
+	FreeSlots(old_slots, old_size);
+}
+
+/*static*/ CLTable::Slot *CLTable::AllocSlots(size_t n)
+{
+	Slot *s = static_cast<Slot*>(CLContext::inst().getPool().allocate(n * sizeof(Slot)));
+	for (size_t i=0; i<n; ++i) new (&s[i]) Slot();
+	return s;
+}
+
+/*static*/ void CLTable::FreeSlots(Slot *s, size_t n)
+{
+	for (size_t i=0; i<n; ++i) s[i].~Slot();
+	CLContext::inst().getPool().release(s, n * sizeof(Slot));
 }
 
 CLTable::Slot *CLTable::FindSlot(CLValue &key, CLTable::Slot *s)
@@ -120,7 +140,7 @@ CLTable::Slot *CLTable::FindSlot(CLValue &key, CLTable::Slot *s)
 bool CLTable::get(CLValue &key, CLValue &value)
 {
 	// special key: "parent"
-	if ((key.type == CL_STRING) && (GET_STRING(key)->get() == "parent"))
+	if ((key.type() == CL_STRING) && (GET_STRING(key)->get() == "parent"))
 	{
 		value = parent;
 		return true;
@@ -133,7 +153,7 @@ bool CLTable::get(CLValue &key, CLValue &value)
 		return true;
 	} else {
 		// not found? look in parent table..
-		if (parent.type == CL_TABLE) return GET_TABLE(parent)->get(key, value);
+		if (parent.type() == CL_TABLE) return GET_TABLE(parent)->get(key, value);
 	}
 
 	return false; // remove compiler warning
@@ -143,9 +163,9 @@ bool CLTable::get(CLValue &key, CLValue &value)
 void CLTable::set(CLValue &key, CLValue &value)
 {
 	// special keys: "parent", null
-	if ((key.type == CL_STRING) && (GET_STRING(key)->get() == "parent"))
+	if ((key.type() == CL_STRING) && (GET_STRING(key)->get() == "parent"))
 	{
-		parent = value;
+		setParent(value);
 		return;
 	} else if (key.isNull()) {
 		return;
@@ -158,6 +178,8 @@ void CLTable::set(CLValue &key, CLValue &value)
 		return;
 	}
 
+	gc_barrier();
+
 	HashKey_t hash = Hash(key);
 	Slot *main_slot = GetSlot(hash);
 
@@ -211,6 +233,7 @@ void CLTable::set(CLValue &key, CLValue &value)
 	}
 
 	// III. Resize table if necessary, and keep free_slot free.
+	changeLayout();
 	++fill;
 	if (fill == size) 
 	{
@@ -225,6 +248,96 @@ void CLTable::set(CLValue &key, CLValue &value)
 	}
 }
 
+bool CLTable::SameKey(CLValue &a, CLValue &b)
+{
+	if (a.type() != b.type()) return false;
+	if (a.type() == CL_STRING) return GET_OBJECT(a) == GET_OBJECT(b) || GET_STRING(a)->get() == GET_STRING(b)->get();
+	return a.type() == CL_INTEGER && GET_INTEGER(a) == GET_INTEGER(b);
+}
+
+bool CLTable::getCached(CLValue &key, CLValue &value, CLTableCache &cache)
+{
+	// hit?
+	if (cache.layout == layout)
+	{
+		CLTable *holder = cache.parent_layout ? GET_TABLE(parent) : this;
+		if (holder->layout == (cache.parent_layout ? cache.parent_layout : layout))
+		{
+			Slot *s = &holder->slots[cache.slot];
+			if (SameKey(s->key, key))
+			{
+				value = s->value;
+				return true;
+			}
+		}
+	}
+
+	// miss: look in this table and its parent, and remember the slot
+	if ((key.type() == CL_STRING) && (GET_STRING(key)->get() == "parent")) return get(key, value);
+
+	Slot *found = FindSlot(key, GetSlot(Hash(key)));
+	if (found)
+	{
+		cache.layout = layout;
+		cache.parent_layout = 0;
+		cache.slot = static_cast<unsigned int>(found - slots);
+		value = found->value;
+		return true;
+	}
+
+	if (parent.type() != CL_TABLE) return false;
+	CLTable *p = GET_TABLE(parent);
+	found = p->FindSlot(key, p->GetSlot(Hash(key)));
+	if (found)
+	{
+		cache.layout = layout;
+		cache.parent_layout = p->layout;
+		cache.slot = static_cast<unsigned int>(found - p->slots);
+		value = found->value;
+		return true;
+	}
+
+	// further up the parent chain
+	if (p->parent.type() == CL_TABLE) return GET_TABLE(p->parent)->get(key, value);
+	return false;
+}
+
+void CLTable::setCached(CLValue &key, CLValue &value, CLTableCache &cache)
+{
+	// only updates of existing slots are cached (nulls remove the slot)
+	if (!value.isNull())
+	{
+		// hit?
+		if (cache.layout == layout && !cache.parent_layout)
+		{
+			Slot *s = &slots[cache.slot];
+			if (SameKey(s->key, key))
+			{
+				s->value = value;
+				gc_barrier();
+				return;
+			}
+		}
+
+		// miss: update existing slot, and remember it
+		if ((key.type() == CL_STRING && GET_STRING(key)->get() != "parent") || key.type() == CL_INTEGER)
+		{
+			Slot *found = FindSlot(key, GetSlot(Hash(key)));
+			if (found)
+			{
+				cache.layout = layout;
+				cache.parent_layout = 0;
+				cache.slot = static_cast<unsigned int>(found - slots);
+				found->value = value;
+				gc_barrier();
+				return;
+			}
+		}
+	}
+
+	set(key, value);
+}
+
 CLValue CLTable::clone()
 {
 	CLTable *dst = new CLTable();
@@ -290,6 +403,7 @@ bool CLTable::remove(CLValue &key)
 
 	*to_clear = Slot();
 
+	changeLayout();
 	--fill;
 
 	// correct 'free_slot'
@@ -301,11 +415,8 @@ bool CLTable::remove(CLValue &key)
 }
 
 // GC
-void CLTable::gc_mark()
+int CLTable::gc_traverse()
 {
-	if (gc_isMarked()) return;
-	gc_setMarked();
-
 	// mark parent
 	parent.markObject();
 
@@ -315,6 +426,8 @@ void CLTable::gc_mark()
 		slots[i].key.markObject();
 		slots[i].value.markObject();
 	}
+
+	return 1 + size;
 }
 
 // iteration support
@@ -26,6 +26,18 @@
 #include "value/clobject.h"
 #include "value/clvalue.h"
 
+// Inline cache of a table access instruction: remembers where the key was found the last time.
+// A table's layout id changes whenever slots are added, moved or removed, or its parent is changed,
+// and is never reused (not even by other tables), so a matching layout id implies a valid slot index.
+struct CLTableCache
+{
+	CLTableCache() : layout(0), parent_layout(0), slot(0) {}
+
+	unsigned long layout;        // layout id of the accessed table (0: empty cache)
+	unsigned long parent_layout; // layout id of the parent table, if the slot was found there (else 0)
+	unsigned int slot;           // slot index
+};
+
 class CLTable : public CLObject
 {
 public:
@@ -33,7 +45,7 @@ public:
 	virtual ~CLTable();
 
 	// set/get parent table
-	void setParent(CLValue parent) { this->parent = parent; }
+	void setParent(CLValue parent) { this->parent = parent; changeLayout(); gc_barrier(); }
 	CLValue getParent() { return this->parent; } 
 
 	// get/set/remove slots
@@ -41,6 +53,10 @@ public:
 	virtual void set(CLValue &key, CLValue &value);
 	bool remove(CLValue &key);
 
+	// get/set slots using an inline cache
+	bool getCached(CLValue &key, CLValue &value, CLTableCache &cache);
+	void setCached(CLValue &key, CLValue &value, CLTableCache &cache);
+
 	// clone
 	virtual CLValue clone();
 
@@ -81,6 +97,14 @@ private:
 	Slot *free_slot; // always points to the first free slot (counting from the top of 'slots' array)
 	CLValue parent; // table parent (must be of type CL_TABLE)
 
+	// layout id (see CLTableCache)
+	unsigned long layout;
+	static unsigned long next_layout;
+	inline void changeLayout() { layout = ++next_layout; }
+
+	// cheap key equality check for cache hits (no false positives)
+	static inline bool SameKey(CLValue &a, CLValue &b);
+
 	// hash function
 	static HashKey_t Hash(CLValue &key);
 
@@ -93,6 +117,10 @@ private:
 	// find slot with equal key in slot chain beginning at 's'
 	Slot *FindSlot(CLValue &key, Slot *s);
 
+	// allocate/free slot arrays from the context's pool
+	static Slot *AllocSlots(size_t n);
+	static void FreeSlots(Slot *s, size_t n);
+
 	// autoresize based on 'fill' and 'size'
 	void Resize(); 
 
@@ -100,7 +128,7 @@ private:
 	void Resize(size_t new_size);
 
 	// GC
-	virtual void gc_mark();
+	virtual int gc_traverse();
 
 };
 
@@ -37,59 +37,60 @@
 #include <sstream>
 #include <iomanip>
 #include <cstring>
+#include <stdexcept>
 #include <assert.h>
 
+void CLValue::setObject(int raw, CLObject *object)
+{
+	unsigned long long ptr = (unsigned long long)(size_t)object;
+	// pointers must fit into the payload, a truncated one would point to some other object
+	if (ptr & ~CL_NANBOX_PAYLOAD) throw std::runtime_error("Object pointer exceeds the 47 bit value payload");
+	value.bits = CL_NANBOX_TAG(raw) | ptr;
+}
+
 CLValue::CLValue(const char *s)
 {
-	type = CL_STRING;
-	value.object = new CLString(s);
+	setObject(CL_RAW_STRING, new CLString(s));
 }
 
 CLValue::CLValue(CLString *str)
 {
-	type = CL_STRING;
-	value.object = str;
+	setObject(CL_RAW_STRING, str);
 }
 
 CLValue::CLValue(CLTable *table)
 {
-	type = CL_TABLE;
-	value.object = table;
+	setObject(CL_RAW_TABLE, table);
 }
 
 CLValue::CLValue(CLArray *array)
 {
-	type = CL_ARRAY;
-	value.object = array;
+	setObject(CL_RAW_ARRAY, array);
 }
 
 CLValue::CLValue(CLFunction *func)
 {
-	type = CL_FUNCTION;
-	value.object = func;
+	setObject(CL_RAW_FUNCTION, func);
 }
 
 CLValue::CLValue(CLExternalFunction *extfunc)
 {
-	type = CL_EXTERNALFUNCTION;
-	value.object = extfunc;
+	setObject(CL_RAW_EXTERNALFUNCTION, extfunc);
 }
 
 CLValue::CLValue(CLUserData *userdata)
 {
-	type = CL_USERDATA;
-	value.object = userdata;
+	setObject(CL_RAW_USERDATA, userdata);
 }
 
 CLValue::CLValue(CLThread *thread)
 {
-	type = CL_THREAD;
-	value.object = thread;
+	setObject(CL_RAW_THREAD, thread);
 }
 
 std::string CLValue::toString()
 {
-	switch (type)
+	switch (type())
 	{
 		case CL_NULL: 	
 			return "null";
@@ -97,19 +98,19 @@ std::string CLValue::toString()
 		case CL_INTEGER:
 		{
 			std::stringstream ss;
-			ss << value.integer;
+			ss << GET_INTEGER(*this);
 			return ss.str();
 		}
 
 		case CL_FLOAT:
 		{
 			std::stringstream ss;
-			ss << std::fixed << value.real;
+			ss << std::fixed << GET_FLOAT(*this);
 			return ss.str();
 		}
 
 		default: 
-			assert(type & CL_RAW_ISOBJECT);
+			assert(isObject());
 			return GET_OBJECT(*this)->toString();
 			// numerics are already handled 
 	}
@@ -119,7 +120,7 @@ std::string CLValue::toString()
 
 std::string CLValue::typeString()
 {
-	switch (type)
+	switch (type())
 	{
 		case CL_NULL: return "null";
 		case CL_INTEGER: return "integer";
@@ -143,9 +144,9 @@ bool CLValue::isEqual(const CLValue &other)
 
 CLValue CLValue::clone()
 {
-	if ((type & CL_RAW_ISOBJECT) == CL_RAW_ISOBJECT)
+	if (isObject())
 	{
-		return value.object->clone();
+		return GET_OBJECT(*this)->clone();
 	} else {
 		return *this;
 	}
@@ -153,7 +154,7 @@ CLValue CLValue::clone()
 
 CLValue CLValue::get(const CLValue &k)
 {
-	if (!(type & CL_RAW_ISOBJECT)) return CLValue::Null();
+	if (!isObject()) return CLValue::Null();
 
 	CLValue key(k), value;
 	GET_OBJECT(*this)->get(key, value);
@@ -162,7 +163,7 @@ CLValue CLValue::get(const CLValue &k)
 
 void CLValue::set(const CLValue &k, const CLValue &v)
 {
-	if (!(type & CL_RAW_ISOBJECT)) return;
+	if (!isObject()) return;
 	
 	CLValue key(k), value(v);
 	GET_OBJECT(*this)->set(key, value);
@@ -175,19 +176,11 @@ void CLValue::set(const CLValue &k, const CLValue &v)
 
 #define ARITH_OPERATION(op, v1, v2) \
 { \
-	if ((v1->type & v2->type & CL_RAW_ISNUMERIC) == CL_RAW_ISNUMERIC) \
+	if (v1->isInteger() && v2->isInteger()) \
 	{ \
-		if ((v1->type == CL_INTEGER) && (v2->type == CL_INTEGER)) \
-		{ \
-			return CLValue(int(v1->value.integer) op int(v2->value.integer)); \
-		} else if ((v1->type == CL_INTEGER) && (v2->type == CL_FLOAT)) { \
-			return CLValue(float(v1->value.integer) op float(v2->value.real)); \
-		} else if ((v1->type == CL_FLOAT) && (v2->type == CL_INTEGER)) { \
-			return CLValue(float(v1->value.real) op float(v2->value.integer)); \
-		} else { \
-			return CLValue(float(v1->value.real) op float(v2->value.real)); \
-		} \
-		assert(0); \
+		return CLValue(int(GET_INTEGER(*v1)) op int(GET_INTEGER(*v2))); \
+	} else if ((v1->isInteger() || v1->isFloat()) && (v2->isInteger() || v2->isFloat())) { \
+		return CLValue(GET_NUMERIC(*v1) op GET_NUMERIC(*v2)); \
 	} \
 }
 
@@ -211,19 +204,9 @@ CLValue CLValue::op_mul(CLValue other)
 
 CLValue CLValue::op_div(CLValue other)
 {
-	if (type == CL_INTEGER)
+	if ((isInteger() || isFloat()) && (other.isInteger() || other.isFloat()))
 	{
-		if (other.type == CL_FLOAT) {
-			return CLValue(float(value.integer) / float(other.value.real));
-		} else if (other.type == CL_INTEGER) {
-			return CLValue(float(value.integer) / float(other.value.integer));
-		}
-	} else if (type == CL_FLOAT) {
-		if (other.type == CL_FLOAT) {
-			return CLValue(float(value.real) / float(other.value.real));
-		} else if (other.type == CL_INTEGER) {
-			return CLValue(float(value.real) / float(other.value.integer));
-		}
+		return CLValue(GET_NUMERIC(*this) / GET_NUMERIC(other));
 	}
 
 	return CLValue::Null();
@@ -231,10 +214,10 @@ CLValue CLValue::op_div(CLValue other)
 
 CLValue CLValue::op_neg()
 {
-	switch (this->type)
+	switch (type())
 	{
-		case CL_INTEGER: return CLValue(- this->value.integer);
-		case CL_FLOAT: return CLValue(- this->value.real);
+		case CL_INTEGER: return CLValue(- GET_INTEGER(*this));
+		case CL_FLOAT: return CLValue(- GET_FLOAT(*this));
 		default: assert(0);
 	}
 	return False();
@@ -245,9 +228,9 @@ CLValue CLValue::op_neg()
 
 #define INTEGER_OPERATION(op, v1, v2) \
 { \
-	if ((v1->type == CL_INTEGER) && (v2->type == CL_INTEGER)) \
+	if (v1->isInteger() && v2->isInteger()) \
 	{ \
-		return CLValue(v1->value.integer op v2->value.integer); \
+		return CLValue(GET_INTEGER(*v1) op GET_INTEGER(*v2)); \
 	} \
 }
 
@@ -293,7 +276,7 @@ CLValue CLValue::op_bitxor(CLValue other)
 
 #define BOOLEAN_OPERATION(op, v1, v2) \
 { \
-	return (v1->type != CL_NULL) op (v2->type != CL_NULL) ? True() : False(); \
+	return v1->isTrue() op v2->isTrue() ? True() : False(); \
 }	
 
 CLValue CLValue::op_booland(CLValue other)
@@ -308,7 +291,7 @@ CLValue CLValue::op_boolor(CLValue other)
 
 CLValue CLValue::op_boolnot()
 {
-	if (this->type == CL_NULL) 
+	if (isNull()) 
 		return True(); // 1 = true
 	else
 		return False(); // null = false
@@ -320,19 +303,11 @@ CLValue CLValue::op_boolnot()
 
 #define ARITH_COMPARE_OPERATION(op, v1, v2) \
 { \
-	if ((v1->type & v2->type & CL_RAW_ISNUMERIC) == CL_RAW_ISNUMERIC) \
+	if (v1->isInteger() && v2->isInteger())\
 	{\
-		if ((v1->type == CL_INTEGER) && (v2->type == CL_INTEGER))\
-		{\
-			return (int(v1->value.integer) op int(v2->value.integer)) ? True() : False();\
-		} else if ((v1->type == CL_INTEGER) && (v2->type == CL_FLOAT)) {\
-			return (float(v1->value.integer) op float(v2->value.real)) ? True() : False();\
-		} else if ((v1->type == CL_FLOAT) && (v2->type == CL_INTEGER)) {\
-			return (float(v1->value.real) op float(v2->value.integer)) ? True() : False();\
-		} else {\
-			return (float(v1->value.real) op float(v2->value.real)) ? True() : False();\
-		}\
-		assert(0);\
+		return (int(GET_INTEGER(*v1)) op int(GET_INTEGER(*v2))) ? True() : False();\
+	} else if ((v1->isInteger() || v1->isFloat()) && (v2->isInteger() || v2->isFloat())) {\
+		return (GET_NUMERIC(*v1) op GET_NUMERIC(*v2)) ? True() : False();\
 	} \
 }
 
@@ -342,26 +317,23 @@ CLValue CLValue::op_eq(CLValue other)
 	// two numbers are equal when they are the same value...
 	ARITH_COMPARE_OPERATION(==, this, (&other));
 
-	// different types other than numeric ones are never equal
-	if (this->type != other.type) return CLValue::False();
-
-	// null == null
-	if ((this->type == CL_NULL) && (other.type == CL_NULL)) return CLValue::True();
+	// null == null, and two objects are equal if they are identical
+	if (value.bits == other.value.bits) return CLValue::True();
 
-	// from here on we compare 2 objects of the same type.
+	// different types other than numeric ones are never equal
+	if (type() != other.type()) return CLValue::False();
 
-	// two objects are equal if they are identical
-	if (this->value.object == other.value.object) return CLValue::True();
+	// from here on we compare 2 different objects of the same type.
 
 	// two strings are equal if they are equal
-	if (this->type == CL_STRING)
+	if (type() == CL_STRING)
 	{
 		if ((GET_STRING(other)->get() == GET_STRING(*this)->get())) return CLValue::True();
 		return False();
 	}
 	
 	// two external functions are equal if they have the same id
-	if (this->type == CL_EXTERNALFUNCTION)
+	if (type() == CL_EXTERNALFUNCTION)
 	{
 		if ((GET_EXTERNALFUNCTION(other)->getFuncID() == GET_EXTERNALFUNCTION(*this)->getFuncID())) return True();
 		return False();
@@ -370,6 +342,11 @@ CLValue CLValue::op_eq(CLValue other)
 	return False();
 }
 
+CLValue CLValue::op_neq(CLValue other)
+{
+	return op_eq(other).op_boolnot();
+}
+
 CLValue CLValue::op_lt(CLValue other)
 {
 	ARITH_COMPARE_OPERATION(<, this, (&other));
@@ -415,7 +392,7 @@ CLValue CLValue::load(class CLSerializer &S)
 
 		case CL_RAW_FLOAT:
 		{
-			float f;
+			double f;
 			S.IO(f);
 			return CLValue(f);
 		}
@@ -479,7 +456,7 @@ CLValue CLValue::load(class CLSerializer &S)
 
 	}
 	
-	assert(0);
+	throw std::runtime_error("Invalid snapshot: unknown value type");
 }
 
 /*static member*/
@@ -488,7 +465,7 @@ void CLValue::save(class CLSerializer &S, CLValue V)
 	int id, tmp;
 
 	// handle non-objects
-	switch (V.type)
+	switch (V.type())
 	{
 		case CL_NULL:
 			S.IO(id = CL_RAW_NULL);
@@ -501,7 +478,7 @@ void CLValue::save(class CLSerializer &S, CLValue V)
 
 		case CL_FLOAT:
 		{
-			float f = GET_FLOAT(V);
+			double f = GET_FLOAT(V);
 			S.IO(id = CL_RAW_FLOAT);
 			S.IO(f);
 			return;
@@ -522,7 +499,7 @@ void CLValue::save(class CLSerializer &S, CLValue V)
 
 	// object was not yet written? -> serialize it
 	ref_id = S.addPtr(GET_OBJECT(V));
-	switch (V.type)
+	switch (V.type())
 	{
 		case CL_STRING:
 			S.IO(id = CL_RAW_STRING);
@@ -615,9 +592,9 @@ std::list<CLValue> CLValue::loadList(CLSerializer &S)
 // GC: Mark object inside (if any)
 void CLValue::markObject()
 {
-	if ((type & CL_RAW_ISOBJECT) == CL_RAW_ISOBJECT) // objects are collectable
+	if (isObject()) // objects are collectable
 	{
-		value.object->gc_mark();
+		GET_OBJECT(*this)->gc_mark();
 	}
 }
 
@@ -55,32 +55,41 @@ enum CLValueType
 	CL_THREAD            = CL_RAW_THREAD           | CL_RAW_ISOBJECT,
 };
 
-#define GET_INTEGER(v)          ((v).value.integer)
+// A CLValue is a single NaN-boxed 64 bit word. Floats are plain doubles (NaNs
+// are canonicalized to CL_NANBOX_NAN), every other type lives in the negative
+// quiet NaN range: bits 63..51 set, bits 50..47 the CL_RAW_* id, bits 46..0 the
+// payload (an integer in the low 32 bits, or an object pointer).
+#define CL_NANBOX_TAGGED        0xFFF8000000000000ULL
+#define CL_NANBOX_NAN           0x7FF8000000000000ULL
+#define CL_NANBOX_PAYLOAD       0x00007FFFFFFFFFFFULL
+#define CL_NANBOX_TAG(raw)      (CL_NANBOX_TAGGED | ((unsigned long long)(raw) << 47))
+
+#define GET_INTEGER(v)          (int((unsigned int)(v).value.bits))
 #define GET_FLOAT(v)            ((v).value.real)
-#define GET_OBJECT(v)           ((v).value.object)
-#define GET_TABLE(v)            ((CLTable*)(v).value.object)
-#define GET_ARRAY(v)            ((CLArray*)(v).value.object)
-#define GET_STRING(v)           ((CLString*)(v).value.object)
-#define GET_FUNCTION(v)         ((CLFunction*)(v).value.object)
-#define GET_EXTERNALFUNCTION(v) ((CLExternalFunction*)(v).value.object)
-#define GET_USERDATA(v)         ((CLUserData*)(v).value.object)
-#define GET_THREAD(v)           ((CLThread*)(v).value.object)
+#define GET_OBJECT(v)           ((CLObject*)((v).value.bits & CL_NANBOX_PAYLOAD))
+#define GET_TABLE(v)            ((CLTable*)GET_OBJECT(v))
+#define GET_ARRAY(v)            ((CLArray*)GET_OBJECT(v))
+#define GET_STRING(v)           ((CLString*)GET_OBJECT(v))
+#define GET_FUNCTION(v)         ((CLFunction*)GET_OBJECT(v))
+#define GET_EXTERNALFUNCTION(v) ((CLExternalFunction*)GET_OBJECT(v))
+#define GET_USERDATA(v)         ((CLUserData*)GET_OBJECT(v))
+#define GET_THREAD(v)           ((CLThread*)GET_OBJECT(v))
 
-#define GET_NUMERIC(v)          ((v).type == CL_INTEGER ? float((v).value.integer) : (v).value.real)
+#define GET_NUMERIC(v)          ((v).isInteger() ? double(GET_INTEGER(v)) : GET_FLOAT(v))
 
 class CLValue
 {
 public:
 	// Construction & Copy ////////////////////////
-	inline CLValue(const CLValue &other) : value(other.value), type(other.type) {}
+	inline CLValue(const CLValue &other) : value(other.value) {}
 	inline ~CLValue() {}
 
-	inline CLValue &operator=(const CLValue &other) { value = other.value; type = other.type; return *this; }
-	inline void setNull() { type = CL_NULL; }
+	inline CLValue &operator=(const CLValue &other) { value = other.value; return *this; }
+	inline void setNull() { value.bits = CL_NANBOX_TAG(CL_RAW_NULL); }
 
-	explicit inline CLValue() : type(CL_NULL) {} // initialize nulled
-	explicit inline CLValue(int i) : type(CL_INTEGER) { value.integer = i; }
-	explicit inline CLValue(float f) : type(CL_FLOAT) { value.real = f; }
+	explicit inline CLValue() { value.bits = CL_NANBOX_TAG(CL_RAW_NULL); } // initialize nulled
+	explicit inline CLValue(int i) { value.bits = CL_NANBOX_TAG(CL_RAW_INTEGER) | (unsigned int)i; }
+	explicit inline CLValue(double f) { value.real = f; if (f != f) value.bits = CL_NANBOX_NAN; }
 	explicit CLValue(const char *s);
 	explicit CLValue(class CLString *str);
 	explicit CLValue(class CLTable *table);
@@ -95,9 +104,13 @@ public:
 	static inline CLValue &Null() { static CLValue v; return v; }
 
 	// 
-	inline bool isTrue() { return this->type != CL_NULL; }
-	inline bool isFalse() { return this->type == CL_NULL; }
-	inline bool isNull() { return this->type == CL_NULL; }
+	inline bool isTrue() const { return value.bits != CL_NANBOX_TAG(CL_RAW_NULL); }
+	inline bool isFalse() const { return value.bits == CL_NANBOX_TAG(CL_RAW_NULL); }
+	inline bool isNull() const { return value.bits == CL_NANBOX_TAG(CL_RAW_NULL); }
+
+	inline bool isInteger() const { return (value.bits >> 32) == (CL_NANBOX_TAG(CL_RAW_INTEGER) >> 32); }
+	inline bool isFloat() const { return value.bits < CL_NANBOX_TAGGED; }
+	inline bool isObject() const { return value.bits >= CL_NANBOX_TAG(CL_RAW_TABLE); }
 
 	// clone inside object, or copy inside value
 	CLValue clone();
@@ -114,15 +127,20 @@ public:
 	void set(const CLValue &k, const CLValue &v);
 
 	// Type & Value////////////////////////////////
+	inline CLValueType type() const
+	{
+		if (isFloat()) return CL_FLOAT;
+		int raw = int(value.bits >> 47) & 0x0F;
+		if (raw == CL_RAW_NULL) return CL_NULL;
+		return CLValueType(raw | (raw == CL_RAW_INTEGER ? CL_RAW_ISNUMERIC : CL_RAW_ISOBJECT));
+	}
+
 	union
 	{
-		int integer;
-		float real;
-		class CLObject *object;
+		unsigned long long bits;
+		double real;
 	} value;
 
-	CLValueType type;
-
 	// CLValue operations
 	// arithmetic
 	CLValue op_add(CLValue other);
@@ -146,6 +164,7 @@ public:
 	
 	// comparison
 	CLValue op_eq(CLValue other);
+	CLValue op_neq(CLValue other);
 	CLValue op_lt(CLValue other);
 	CLValue op_gt(CLValue other);
 	CLValue op_le(CLValue other);
@@ -163,6 +182,9 @@ public:
 
 	// GC: Mark object inside (if any)
 	void markObject();
+
+private:
+	void setObject(int raw, class CLObject *object);
 };
 
 #endif
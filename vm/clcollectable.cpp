@@ -21,10 +21,11 @@
 #include "vm/clcollectable.h"
 #include "vm/clcontext.h"
 
+#include <assert.h>
 #include <iostream>
 using namespace std;
 
-CLCollectable::CLCollectable() : marked(false), finalized(false), prev(0), next(0), lock_cnt(0)
+CLCollectable::CLCollectable() : color(CL_GC_WHITE), age(0), finalized(false), prev(0), next(0), lock_cnt(0)
 {
 	CLContext::inst().addToHeapList(this);
 }
@@ -33,19 +34,70 @@ CLCollectable::~CLCollectable()
 {
 }
 
+void *CLCollectable::operator new(size_t size)
+{
+	CLContext &context = CLContext::inst();
+	void *p = context.gc_pool.allocate(size);
+	context.gc_heap_bytes += size;
+	++context.gc_object_count;
+	return p;
+}
+
+void CLCollectable::operator delete(void *p, size_t size)
+{
+	// objects never outlive the context, it deletes all of them on shutdown
+	CLContext *context = CLContext::instance;
+	assert(context);
+	context->gc_heap_bytes -= size;
+	--context->gc_object_count;
+	context->gc_pool.release(p, size);
+}
+
 void CLCollectable::gc_mark()
 {
-	gc_setMarked();
+	CLContext *context = CLContext::instance;
+	if (context->gc_minor)
+	{
+		// minor collection: old objects are not traversed, but note that a young one is referenced
+		if (age >= CL_GC_OLD) return;
+		context->gc_young_seen = true;
+	}
+
+	if (color != CL_GC_WHITE) return;
+	color = CL_GC_GRAY;
+	context->gc_gray.push_back(this);
 }
 
 bool CLCollectable::gc_isMarked()
 {
-	return marked;
+	return color != CL_GC_WHITE;
+}
+
+int CLCollectable::gc_traverse()
+{
+	return 1;
 }
 
-void CLCollectable::gc_setMarked()
+void CLCollectable::gc_barrierSlow()
 {
-	marked = true;
+	CLContext *context = CLContext::instance;
+
+	// Black objects are only ever changed behind the collector's back while it is marking
+	// (when sweeping they are just waiting to be whitened). Such an object is grayed again,
+	// and traversed once more in the atomic step that finishes marking.
+	if (color == CL_GC_BLACK && context->gc_state == CL_GC_MARK)
+	{
+		color = CL_GC_GRAY;
+		context->gc_grayagain.push_back(this);
+	}
+
+	// A changed old object might reference young objects now, so the next minor collection has to
+	// traverse it. (There are no young objects during a major cycle.)
+	if (age == CL_GC_OLD && context->gc_state == CL_GC_IDLE)
+	{
+		age = CL_GC_REMEMBERED;
+		context->gc_remembered.push_back(this);
+	}
 }
 
 void CLCollectable::gc_finalize()
@@ -21,19 +21,41 @@
 #ifndef CL_COLLECTABLE_H
 #define CL_COLLECTABLE_H
 
+#include <cstddef>
+
+// tri-color marking: white objects are not (yet) reached, gray ones are reached but their references
+// are not traversed yet, black ones are done.
+#define CL_GC_WHITE 0
+#define CL_GC_GRAY  1
+#define CL_GC_BLACK 2
+
+// generations: a young object counts the minor collections it survived in 'age', and is promoted to the
+// old generation when it reaches the promotion age. Old objects which might reference young ones are
+// in the remembered set.
+#define CL_GC_OLD        254
+#define CL_GC_REMEMBERED 255 // old, in remembered set
+
 class CLCollectable
 {
 public:
 	CLCollectable();
 	virtual ~CLCollectable();
 
+	// account heap size and object count in the context
+	static void *operator new(size_t size);
+	static void operator delete(void *p, size_t size);
+
 protected:
 	friend class CLContext;
 	friend class CLValue;
 
-	virtual void gc_mark();
+	void gc_mark(); // white -> gray
 	bool gc_isMarked();
-	void gc_setMarked();
+	virtual int gc_traverse(); // mark all referenced objects, returns the work done (~ values visited)
+
+	// write barrier: call after storing a reference into this object
+	inline void gc_barrier() { if (color == CL_GC_BLACK || age == CL_GC_OLD) gc_barrierSlow(); }
+	void gc_barrierSlow();
 
 	bool gc_isFinalized();
 	void gc_setFinalized();
@@ -45,7 +67,8 @@ protected:
 	inline bool gc_isLocked() { return lock_cnt > 0; }
 
 private:
-	bool marked;
+	unsigned char color;
+	unsigned char age;
 	bool finalized;
 	CLCollectable *prev, *next;
 
@@ -22,10 +22,12 @@
 
 #include "value/clvalue.h"
 #include "value/cltable.h"
+#include "value/clexternalfunction.h"
 
 #include "vm/clmathmodule.h"
 
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
 
 #include "serialize/clserializer.h"
@@ -38,7 +40,10 @@ using namespace std;
 int ocount = 0;
 #endif
 
-CLContext::CLContext() : gc_heap_list(0), gc_finalized_list(0)
+CLContext::CLContext() : gc_heap_list(0), gc_old_list(0), gc_finalized_list(0), gc_state(CL_GC_IDLE), gc_step_budget(CL_GC_STEP_BUDGET), gc_sweep(0),
+	gc_young_count(0), gc_nursery_size(CL_GC_NURSERY_SIZE), gc_promote_age(CL_GC_PROMOTE_AGE), gc_minor(false), gc_young_seen(false),
+	gc_heap_bytes(0), gc_object_count(0), gc_threshold(CL_GC_MIN_HEAP), gc_growth_factor(CL_GC_GROWTH_FACTOR), gc_min_heap(CL_GC_MIN_HEAP),
+	gc_manual(false)
 {
 	if (instance) throw std::runtime_error("VM context already created!");
 	instance = this;
@@ -67,28 +72,30 @@ CLContext &CLContext::inst()
 
 void CLContext::shutdown()
 {
-	// Free root table //////////////////////////////////
+	// Free root table, methods and host roots //////////
 	roottable.setNull();
+	for (int i=0; i<CL_NUM_METHODS; ++i) methods[i].setNull();
+	gc_visible.clear();
+
+	// Abort incremental collection /////////////////////
+	gc_state = CL_GC_IDLE;
+	gc_gray.clear();
+	gc_grayagain.clear();
+	gc_sweep = 0;
 
 	// Finalized all remaining objects //////////////////
-	if (gc_heap_list)
+	while (gc_heap_list) // finalizers might allocate new objects
 	{
-	redo:
-		CLCollectable *it = gc_heap_list;
-		while (it)
-		{
-			if (!it->gc_isFinalized()) 
-			{
-				it->gc_finalize();
-				moveToFinalizedList(it);
-				goto redo; // finalization might invalidate iterator 'it'
-			}
-			it = it->next;
-		}
+		promoteYoung();
+
+		CLCollectable *dead = gc_heap_list;
+		gc_heap_list = gc_old_list = 0;
+		finalizeObjects(dead);
 	}
 
 	// Free finalized objects ///////////////////////////
 	freeFinalized();
+	gc_threshold = gc_min_heap;
 
 #ifdef DEBUG
 	if (ocount != 0)            clog << "Internal error: Uncollected objects left after shutdown." << endl;
@@ -104,14 +111,14 @@ void CLContext::shutdown()
 
 void CLContext::registerThread(CLValue thread) // called by thread constructor
 {
-	assert(thread.type == CL_THREAD);
+	assert(thread.type() == CL_THREAD);
 
 	threads.push_back(thread);
 }
 
 void CLContext::unregisterThread(CLValue thread) // called by thread destructor
 {
-	assert(thread.type == CL_THREAD);
+	assert(thread.type() == CL_THREAD);
 
 	std::list<CLValue>::iterator it = threads.begin(), end = threads.end();
 	for (;it!=end;++it)
@@ -148,6 +155,17 @@ CLExternalFunctionPtr CLContext::getExternalFunctionPtr(const std::string &func_
 	return 0;
 }
 
+CLNativeFunctionPtr CLContext::getNativeFunctionPtr(const std::string &func_id)
+{
+	std::list<CLModule*>::iterator it = modules.begin(), end = modules.end();
+	for (;it!=end;++it)
+	{
+		CLNativeFunctionPtr p = (*it)->getNativeFunctionPtr(func_id);
+		if (p) return p;
+	}
+	return 0;
+}
+
 void CLContext::addModule(CLModule *module)
 {
 	modules.push_back(module);
@@ -168,6 +186,8 @@ void CLContext::roundRobin(int timeout)
 		CLValue &thread = *it;
 		if (GET_THREAD(thread)->isRunning()) GET_THREAD(thread)->run(timeout);
 	}
+
+	if (!gc_manual) collectAuto();
 }
 
 void CLContext::clear()
@@ -175,6 +195,13 @@ void CLContext::clear()
 	shutdown();
 	roottable = CLValue(new CLTable());
 
+	// create built-in methods (functions of the sys module)
+	static const char *method_ids[CL_NUM_METHODS] = {
+		"sys_string_length", "sys_string_clone", "sys_string_concat", "sys_string_substr", "sys_string_replace",
+		"sys_thread_kill", "sys_thread_isrunning", "sys_thread_suspend", "sys_thread_resume",
+	};
+	for (int i=0; i<CL_NUM_METHODS; ++i) methods[i] = CLValue(new CLExternalFunction(method_ids[i]));
+
 	// reinit all modules
 	std::list<CLModule*>::iterator it = modules.begin(), end = modules.end();
 	for (;it!=end; ++it)
@@ -246,82 +273,386 @@ void CLContext::load(CLSerializer &S)
 
 void CLContext::markObjects()
 {
-	// mark root table
+	// objects changed during an incremental cycle in progress are still gray
+	gc_gray.insert(gc_gray.end(), gc_grayagain.begin(), gc_grayagain.end());
+	gc_grayagain.clear();
+
+	markRoots();
+	propagateMarks(-1);
+
+	gc_state = CL_GC_IDLE;
+	gc_sweep = 0;
+}
+
+void CLContext::sweepObjects()
+{
+	// survivors become old, including objects allocated since unmarkObjects()
+	promoteYoung();
+
+	gc_sweep = gc_heap_list;
+	sweepStep(-1);
+	gc_state = CL_GC_IDLE;
+}
+
+bool CLContext::collectStep(int budget)
+{
+	if (gc_state == CL_GC_IDLE)
+	{
+		// start a new cycle, all objects are white here
+		promoteYoung();
+		gc_state = CL_GC_MARK;
+		markRoots();
+	}
+
+	if (gc_state == CL_GC_MARK)
+	{
+		propagateMarks(budget);
+		if (!gc_gray.empty()) return false;
+
+		finishMarking();
+		gc_state = CL_GC_SWEEP;
+		gc_sweep = gc_heap_list;
+		return false;
+	}
+
+	if (gc_state == CL_GC_SWEEP)
+	{
+		sweepStep(budget);
+		if (gc_sweep) return false;
+
+		gc_state = CL_GC_FREE;
+		return false;
+	}
+
+	freeStep(budget);
+	if (gc_finalized_list) return false;
+
+	gc_state = CL_GC_IDLE;
+	updateThreshold();
+	return true;
+}
+
+void CLContext::markRoots()
+{
+	// mark root table, methods and host roots
 	roottable.markObject();
+	for (int i=0; i<CL_NUM_METHODS; ++i) methods[i].markObject();
+	std::list<CLCollectable*>::iterator rit = gc_visible.begin(), rend = gc_visible.end();
+	for (;rit!=rend;++rit) (*rit)->gc_mark();
 
 	// mark all running threads
 	std::list<CLValue>::iterator it = threads.begin(), end = threads.end();
 	for (;it!=end;++it) if (GET_THREAD(*it)->isRunning()) it->markObject();
 }
 
-void CLContext::sweepObjects()
+int CLContext::propagateMarks(int budget)
 {
-redo:
-	CLCollectable *it = gc_heap_list;
-	while (it)
+	while (!gc_gray.empty() && budget != 0)
 	{
-		if (!it->gc_isMarked() && !it->gc_isLocked()) 
+		CLCollectable *C = gc_gray.back();
+		gc_gray.pop_back();
+
+		C->color = CL_GC_BLACK;
+		int work = C->gc_traverse();
+		if (budget > 0) budget = work < budget ? budget - work : 0;
+	}
+	return budget;
+}
+
+void CLContext::finishMarking()
+{
+	// Threads and other objects changed since they were traversed are in 'gc_grayagain'. Traversing
+	// them again without interruption makes sure no reference stored by the mutator is missed.
+	markRoots();
+	gc_gray.insert(gc_gray.end(), gc_grayagain.begin(), gc_grayagain.end());
+	gc_grayagain.clear();
+	propagateMarks(-1);
+}
+
+int CLContext::sweepStep(int budget)
+{
+	// Unlink unreachable objects first, survivors become white again for the next cycle. Finalizers
+	// only run afterwards on the unlinked objects, so they can't disturb the heap list walk, and
+	// objects they allocate are put in front of 'gc_sweep'.
+	CLCollectable *dead = 0;
+	while (gc_sweep && budget != 0)
+	{
+		CLCollectable *C = gc_sweep;
+		gc_sweep = C->next;
+		if (C->color == CL_GC_WHITE && !C->gc_isLocked())
 		{
-			it->gc_finalize();
-			moveToFinalizedList(it);
-			goto redo; // finalization invalidates iterator 'it'
+			removeFromHeapList(C);
+			C->next = dead;
+			dead = C;
+		} else {
+			C->color = CL_GC_WHITE;
+			C->age = CL_GC_OLD;
 		}
-		it = it->next;
+		if (budget > 0) --budget;
+	}
+
+	finalizeObjects(dead);
+	return budget;
+}
+
+void CLContext::finalizeObjects(CLCollectable *list)
+{
+	while (list)
+	{
+		CLCollectable *C = list;
+		list = list->next;
+
+		C->prev = C->next = 0;
+		C->gc_finalize();
+		addToFinalizedList(C);
 	}
 }
 
 void CLContext::addToHeapList(CLCollectable *C)
 {
 	assert(C);
-
-	// add to heap list
 	assert(C->prev == 0);
 	assert(C->next == 0);
 
-	C->prev = 0;
-	C->next = gc_heap_list;
-	gc_heap_list = C;
+	linkObject(gc_heap_list, C);
+
+	// new objects are young, except during a major cycle (which can't handle two generations)
+	if (gc_state == CL_GC_IDLE)
+	{
+		C->age = 0;
+		++gc_young_count;
+		return;
+	}
 
-	if (gc_heap_list->next) gc_heap_list->next->prev = gc_heap_list;
+	C->age = CL_GC_OLD;
+	gc_old_list = C;
+
+	// objects created while marking are traversed in this cycle, too
+	if (gc_state == CL_GC_MARK) C->gc_mark();
 }
 
-void CLContext::moveToFinalizedList(CLCollectable *C)
+void CLContext::removeFromHeapList(CLCollectable *C)
 {
 	assert(C);
 
-	// remove from heap list
 	if (C->prev) C->prev->next = C->next;
 	if (C->next) C->next->prev = C->prev;
 	if (C == gc_heap_list) gc_heap_list = C->next;
+	if (C == gc_old_list) gc_old_list = C->next;
+}
+
+void CLContext::addToFinalizedList(CLCollectable *C)
+{
+	linkObject(gc_finalized_list, C);
+}
+
+/*static*/ void CLContext::linkObject(CLCollectable *&list, CLCollectable *C)
+{
+	assert(C);
 
-	// add to finalized list
 	C->prev = 0;
-	C->next = gc_finalized_list;
-	gc_finalized_list = C;
-	if (gc_finalized_list->next) gc_finalized_list->next->prev = gc_finalized_list;
+	C->next = list;
+	list = C;
+	if (C->next) C->next->prev = C;
 }
 
 void CLContext::freeFinalized()
 {
-	CLCollectable *it = gc_finalized_list;
-	while (it)
+	freeStep(-1);
+}
+
+int CLContext::freeStep(int budget)
+{
+	while (gc_finalized_list && budget != 0)
 	{
-		CLCollectable *del = it;
-		it = it->next;
+		CLCollectable *del = gc_finalized_list;
+		gc_finalized_list = del->next;
+		if (gc_finalized_list) gc_finalized_list->prev = 0;
 		delete del;
+		if (budget > 0) --budget;
 	}
-
-	gc_finalized_list = 0;
+	return budget;
 }
 
 void CLContext::unmarkObjects()
 {
+	// abort an incremental cycle in progress
+	gc_state = CL_GC_IDLE;
+	gc_gray.clear();
+	gc_grayagain.clear();
+	gc_sweep = 0;
+
+	promoteYoung();
+
 	CLCollectable *it = gc_heap_list;
 	while (it)
 	{
-		it->marked = false;
+		it->color = CL_GC_WHITE;
+		it->age = CL_GC_OLD;
 		it = it->next;
 	}
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Generational garbage collection                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+void CLContext::collectYoung()
+{
+	// there are no young objects during a major cycle
+	if (gc_state != CL_GC_IDLE) return;
+
+	// mark young objects reachable from the roots
+	gc_minor = true;
+	markRoots();
+
+	// Mark young objects referenced by remembered old objects. An old object which still references
+	// young ones stays in the remembered set until they are promoted, since it won't pass the write
+	// barrier again unless it's changed.
+	size_t kept = 0;
+	for (size_t i=0; i<gc_remembered.size(); ++i)
+	{
+		CLCollectable *C = gc_remembered[i];
+		gc_young_seen = false;
+		C->gc_traverse();
+		if (gc_young_seen) gc_remembered[kept++] = C; else C->age = CL_GC_OLD;
+	}
+	gc_remembered.resize(kept);
+
+	propagateMarks(-1);
+	gc_minor = false;
+
+	// Sweep young objects: unlink unreachable ones, and move the survivors old enough in front of
+	// the old objects.
+	CLCollectable *dead = 0, *promoted = 0, *promoted_last = 0, *young_last = 0;
+	CLCollectable *it = gc_heap_list;
+	while (it != gc_old_list)
+	{
+		CLCollectable *C = it;
+		it = it->next;
+
+		if (C->color == CL_GC_WHITE && !C->gc_isLocked())
+		{
+			removeFromHeapList(C);
+			--gc_young_count;
+			C->next = dead;
+			dead = C;
+			continue;
+		}
+
+		C->color = CL_GC_WHITE;
+		if (++C->age < gc_promote_age)
+		{
+			young_last = C;
+			continue;
+		}
+
+		// its references might still be young
+		removeFromHeapList(C);
+		--gc_young_count;
+		linkObject(promoted, C);
+		if (!promoted_last) promoted_last = C;
+		C->age = CL_GC_REMEMBERED;
+		gc_remembered.push_back(C);
+	}
+
+	if (promoted)
+	{
+		if (young_last) young_last->next = promoted; else gc_heap_list = promoted;
+		promoted->prev = young_last;
+		promoted_last->next = gc_old_list;
+		if (gc_old_list) gc_old_list->prev = promoted_last;
+		gc_old_list = promoted;
+	}
+
+	finalizeObjects(dead);
+	freeFinalized();
+}
+
+void CLContext::setGCPromoteAge(int age)
+{
+	if (age < 1) age = 1;
+	if (age >= CL_GC_OLD) age = CL_GC_OLD - 1;
+	gc_promote_age = age;
+}
+
+void CLContext::promoteYoung()
+{
+	// without young objects there is no need for a remembered set
+	for (size_t i=0; i<gc_remembered.size(); ++i) gc_remembered[i]->age = CL_GC_OLD;
+	gc_remembered.clear();
+
+	gc_old_list = gc_heap_list;
+	gc_young_count = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Garbage collection policy                                                  //
+////////////////////////////////////////////////////////////////////////////////
+
+void CLContext::addRoot(CLValue value)
+{
+	if (!value.isObject()) return;
+	gc_visible.push_back(GET_OBJECT(value));
+
+	// a root added while marking is marked by finishMarking()
+}
+
+void CLContext::removeRoot(CLValue value)
+{
+	if (!value.isObject()) return;
+	std::list<CLCollectable*>::iterator it = std::find(gc_visible.begin(), gc_visible.end(), GET_OBJECT(value));
+	if (it != gc_visible.end()) gc_visible.erase(it);
+}
+
+void CLContext::collectGarbage(int mode)
+{
+	if (mode == CL_GC_MINOR)
+	{
+		collectYoung();
+		return;
+	}
+
+	unmarkObjects();
+	markObjects();
+	sweepObjects();
+	freeFinalized();
+	updateThreshold();
+}
+
+void CLContext::collectAuto()
+{
+	if (gc_state == CL_GC_IDLE && gc_heap_bytes < gc_threshold)
+	{
+		if (gc_nursery_size > 0 && gc_young_count >= gc_nursery_size) collectGarbage(CL_GC_MINOR);
+		return;
+	}
+
+	// Start or continue a major cycle. If the threads allocate faster than the steps collect, and
+	// the heap grows by the growth factor again, the cycle is completed at once.
+	if (gc_step_budget <= 0 || gc_heap_bytes >= gc_threshold * gc_growth_factor)
+	{
+		if (gc_state == CL_GC_IDLE) collectGarbage(CL_GC_FULL); else while (!collectStep(-1)) {}
+		return;
+	}
+
+	collectStep(gc_step_budget);
+}
+
+void CLContext::updateThreshold()
+{
+	gc_threshold = static_cast<size_t>(gc_heap_bytes * gc_growth_factor);
+	if (gc_threshold < gc_min_heap) gc_threshold = gc_min_heap;
+}
 
+void CLContext::setGCGrowthFactor(double factor)
+{
+	if (factor < 1.1) factor = 1.1;
+	gc_growth_factor = factor;
+}
+
+void CLContext::setGCMinHeap(size_t bytes)
+{
+	gc_min_heap = bytes;
+	if (gc_threshold < gc_min_heap) gc_threshold = gc_min_heap;
+}
@@ -26,16 +26,58 @@
 #include "vm/clthread.h"
 #include "vm/clmodule.h"
 #include "vm/clsysmodule.h"
+#include "vm/clpool.h"
 
 #include <list>
+#include <vector>
 #include <string>
 
+// states of the incremental garbage collector
+#define CL_GC_IDLE  0 // no collection cycle in progress
+#define CL_GC_MARK  1 // marking, write barriers are active
+#define CL_GC_SWEEP 2 // sweeping the heap list
+#define CL_GC_FREE  3 // deleting finalized objects
+
+// default work budget of collectStep() and of the steps done by roundRobin()
+// (roughly values traversed or objects swept)
+#define CL_GC_STEP_BUDGET 10000
+
+// default number of minor collections a young object has to survive to be promoted
+#define CL_GC_PROMOTE_AGE 2
+
+// default young generation size (objects) triggering a minor collection in roundRobin()
+#define CL_GC_NURSERY_SIZE 20000
+
+// roundRobin() starts a major cycle when the heap has grown by this factor since the last one,
+// but not below the minimum heap size (bytes)
+#define CL_GC_GROWTH_FACTOR 2.0
+#define CL_GC_MIN_HEAP (1024 * 1024)
+
+// collectGarbage() modes
+#define CL_GC_FULL  0 // stop-the-world major collection
+#define CL_GC_MINOR 1 // minor collection of the young generation
+
 #ifdef DEBUG
 extern int ocount;
 #endif
 
 class CLUserDataSerializer;
 
+// built-in methods of strings and threads (see CLContext::getMethod)
+enum CLMethod
+{
+	CL_METHOD_STRING_LENGTH,
+	CL_METHOD_STRING_CLONE,
+	CL_METHOD_STRING_CONCAT,
+	CL_METHOD_STRING_SUBSTR,
+	CL_METHOD_STRING_REPLACE,
+	CL_METHOD_THREAD_KILL,
+	CL_METHOD_THREAD_ISRUNNING,
+	CL_METHOD_THREAD_SUSPEND,
+	CL_METHOD_THREAD_RESUME,
+	CL_NUM_METHODS
+};
+
 class CLContext
 {
 public:
@@ -48,6 +90,9 @@ public:
 	//
 	inline CLValue &getRootTable() { return roottable; }
 
+	// external function of a built-in method, shared by all strings/threads (resolved once)
+	inline CLValue &getMethod(CLMethod method) { return methods[method]; }
+
 	int countRunningThreads();
 
 	void roundRobin(int timeout = -1);
@@ -56,6 +101,7 @@ public:
 	void addModule(CLModule *module);
 	void removeModule(CLModule *module);
 	CLExternalFunctionPtr getExternalFunctionPtr(const std::string &func_id);
+	CLNativeFunctionPtr getNativeFunctionPtr(const std::string &func_id);
 
 	// Save, Load, Clear complete context
 	void clear();
@@ -64,6 +110,7 @@ public:
 
 private:
 	CLValue roottable; // Global variables
+	CLValue methods[CL_NUM_METHODS]; // Built-in methods
 
 	// Threads
 	friend class CLThread;
@@ -75,14 +122,53 @@ private:
 	std::list<CLModule*> modules;
 	CLSysModule sys;
 
+	// Memory of collectible objects and table slots
+	CLPool gc_pool;
+
 	// GC lists
-	std::list<CLCollectable*> gc_visible; // List of objects which are always visible
+	std::list<CLCollectable*> gc_visible; // List of objects which are always visible (host roots, see addRoot)
 	CLCollectable *gc_heap_list;          // Chained list of all collectible objects on heap (via CLCollectable::next)
+	CLCollectable *gc_old_list;           // First old object in heap list, all young objects are in front of it
 	CLCollectable *gc_finalized_list;     // Chained list of all finalized objects awaiting destruction (via CLCollectable::next)
 
+	// incremental GC state
+	int gc_state;                             // CL_GC_IDLE, CL_GC_MARK, CL_GC_SWEEP or CL_GC_FREE
+	int gc_step_budget;                       // budget of the steps done by roundRobin() (0: collect at once)
+	std::vector<CLCollectable*> gc_gray;      // gray objects waiting to be traversed
+	std::vector<CLCollectable*> gc_grayagain; // black objects changed while marking (see write barrier)
+	CLCollectable *gc_sweep;                  // next object to sweep in heap list
+
+	// generational GC state
+	std::vector<CLCollectable*> gc_remembered; // old objects which might reference young ones
+	int gc_young_count;                        // number of young objects
+	int gc_nursery_size;                       // young objects triggering a minor collection in roundRobin() (0: none)
+	int gc_promote_age;                        // minor collections survived by young objects to be promoted
+	bool gc_minor;                             // minor collection in progress
+	bool gc_young_seen;                        // set when marking a young object in a minor collection
+
+	// heap policy
+	size_t gc_heap_bytes;     // size of all collectible objects (not including their buffers)
+	int gc_object_count;      // number of all collectible objects
+	size_t gc_threshold;      // heap size starting the next major cycle
+	double gc_growth_factor;  // heap growth (relative to the size after the last major cycle) starting the next one
+	size_t gc_min_heap;       // minimum threshold
+	bool gc_manual;           // no collections by roundRobin()
+
 	friend class CLCollectable;
-	void addToHeapList(CLCollectable *C); // add object to heap list
-	void moveToFinalizedList(CLCollectable *C); // move object from heap list to finalized list
+	void addToHeapList(CLCollectable *C); // add new object to heap list
+	void removeFromHeapList(CLCollectable *C); // unlink object from heap list
+	void addToFinalizedList(CLCollectable *C); // add unlinked object to finalized list
+	static void linkObject(CLCollectable *&list, CLCollectable *C); // add unlinked object to front of 'list'
+	void finalizeObjects(CLCollectable *list); // finalize objects chained via 'next', move them to finalized list
+
+	void markRoots();                  // gray root table and running threads
+	int propagateMarks(int budget);    // traverse gray objects, returns remaining budget (no limit if < 0)
+	void finishMarking();              // atomic step: traverse roots and changed objects again
+	int sweepStep(int budget);         // sweep objects in heap list from 'gc_sweep' on, returns remaining budget
+	int freeStep(int budget);          // delete finalized objects, returns remaining budget
+	void promoteYoung();               // make all young objects old (their age is fixed when sweeping), clear remembered set
+	void collectAuto();                // collection policy of roundRobin()
+	void updateThreshold();            // set threshold after a major cycle
 
 	// Singleton instance
 	static CLContext *instance;
@@ -91,11 +177,56 @@ private:
 	void shutdown();
 
 public:
-	// GC
+	// GC: unless in manual mode, roundRobin() collects garbage after each round: It does a major cycle
+	// when the heap has grown by the growth factor since the last one (incrementally, in steps of the
+	// step budget), and else a minor collection when the young generation has grown to the nursery
+	// size. The size of the heap is the size of the collectible objects only, the memory held by them
+	// (strings, table slots, array elements, thread stacks) is not counted.
+	//
+	// Only objects reachable from the root table, running threads and the roots added by the host
+	// survive a collection. A value the host keeps between roundRobin() calls (a function to start
+	// threads with, a finished thread, a table it builds) must be added with addRoot() until it's no
+	// longer used. Roots are counted: every addRoot() needs its removeRoot().
+	void addRoot(CLValue value);
+	void removeRoot(CLValue value);
+	void collectGarbage(int mode = CL_GC_FULL);
+	void setGCManual(bool manual) { gc_manual = manual; }
+	bool isGCManual() { return gc_manual; }
+	void setGCGrowthFactor(double factor);
+	double getGCGrowthFactor() { return gc_growth_factor; }
+	void setGCMinHeap(size_t bytes);
+	size_t getGCMinHeap() { return gc_min_heap; }
+	size_t getGCThreshold() { return gc_threshold; }
+	size_t getHeapBytes() { return gc_heap_bytes; }
+	CLPool &getPool() { return gc_pool; }
+	int countObjects() { return gc_object_count; }
+
+	// Stop-the-world collection, call unmarkObjects, markObjects, sweepObjects and freeFinalized
+	// in this order (this also completes an incremental cycle in progress)
 	void markObjects();
 	void unmarkObjects();
 	void sweepObjects();
 	void freeFinalized();
+
+	// Incremental GC: do about 'budget' units of marking or sweeping work, interleaved with the
+	// threads. Returns true if this completed a collection cycle. roundRobin() does steps with the
+	// budget set by setGCStepBudget() (0: stop-the-world), and might complete a cycle started here
+	// too, so use getGCState() to wait for the end of a cycle.
+	bool collectStep(int budget = CL_GC_STEP_BUDGET);
+	void setGCStepBudget(int budget) { gc_step_budget = budget; }
+	int getGCStepBudget() { return gc_step_budget; }
+	int getGCState() { return gc_state; }
+
+	// Generational GC: a minor collection only marks and sweeps the young objects, reachable from the
+	// roots or the remembered set, and survivors are promoted after surviving 'age' minor collections.
+	// roundRobin() does a minor collection when there are more young objects than set by
+	// setGCNurserySize() (0: never). Major cycles (above) promote all young objects first.
+	void collectYoung();
+	void setGCNurserySize(int objects) { gc_nursery_size = objects; }
+	int getGCNurserySize() { return gc_nursery_size; }
+	void setGCPromoteAge(int age);
+	int getGCPromoteAge() { return gc_promote_age; }
+	int countYoungObjects() { return gc_young_count; }
 };
 
 #endif
@@ -30,7 +30,7 @@
 
 #include <cmath>
 
-#define DECL_FUNC(name) CLValue name (CLThread &thread, std::vector<CLValue> &args, CLValue self)
+#define DECL_FUNC(name) CLValue name (CLThread &thread, CLValue *args, int argc, CLValue self)
 
 #ifndef M_PI
 #define M_PI 3.1416
@@ -63,13 +63,13 @@ CLMathModule::~CLMathModule()
 {
 }
 
-static inline float float_arg0(std::vector<CLValue> &args)
+static inline double float_arg0(CLValue *args, int argc)
 {
-	float result = 0.0f;
-	if (args.size() >= 1) switch (args[0].type)
+	double result = 0.0;
+	if (argc >= 1) switch (args[0].type())
 	{
 		case CL_FLOAT: result = GET_FLOAT(args[0]); break;
-		case CL_INTEGER: result = (float)GET_INTEGER(args[0]); break;
+		case CL_INTEGER: result = (double)GET_INTEGER(args[0]); break;
 		default: assert(0);
 	}
 	return result;
@@ -77,42 +77,42 @@ static inline float float_arg0(std::vector<CLValue> &args)
 
 static DECL_FUNC(math_sin)
 {
-	return CLValue(float(std::sin(float_arg0(args) * M_PI / 180.0f)));
+	return CLValue(std::sin(float_arg0(args, argc) * M_PI / 180.0));
 }
 
 static DECL_FUNC(math_cos)
 {
-	return CLValue(float(std::cos(float_arg0(args) * M_PI / 180.0f)));
+	return CLValue(std::cos(float_arg0(args, argc) * M_PI / 180.0));
 }
 
 static DECL_FUNC(math_tan)
 {
-	return CLValue(float(std::tan(float_arg0(args) * M_PI / 180.0f)));
+	return CLValue(std::tan(float_arg0(args, argc) * M_PI / 180.0));
 }
 
 static DECL_FUNC(math_asin)
 {
-	return CLValue(float(std::asin(float_arg0(args)) / M_PI * 180.0f));
+	return CLValue(std::asin(float_arg0(args, argc)) / M_PI * 180.0);
 }
 
 static DECL_FUNC(math_acos)
 {
-	return CLValue(float(std::acos(float_arg0(args)) / M_PI * 180.0f));
+	return CLValue(std::acos(float_arg0(args, argc)) / M_PI * 180.0);
 }
 
 static DECL_FUNC(math_atan)
 {
-	return CLValue(float(std::atan(float_arg0(args)) / M_PI * 180.0f));
+	return CLValue(std::atan(float_arg0(args, argc)) / M_PI * 180.0);
 }
 
 static DECL_FUNC(math_sqrt)
 {
-	return CLValue(float(std::sqrt(float_arg0(args))));
+	return CLValue(std::sqrt(float_arg0(args, argc)));
 }
 
 static DECL_FUNC(math_random)
 {
-	switch (args.size())
+	switch (argc)
 	{
 		case 0: return CLValue((int)std::rand());
 		case 1: 
@@ -46,6 +46,16 @@ CLExternalFunctionPtr CLModule::getExternalFunctionPtr(const std::string &ident)
 	return 0;
 }
 
+CLNativeFunctionPtr CLModule::getNativeFunctionPtr(const std::string &ident)
+{
+	std::list<RegisteredFunction>::iterator it = reg_funcs.begin(), end = reg_funcs.end();
+	for (; it!=end; ++it)
+	{
+		if (ident == it->id) return it->native;
+	}
+	return 0;
+}
+
 void CLModule::registerFunction(std::string name, std::string id, CLExternalFunctionPtr func)
 {
 	reg_funcs.push_back(RegisteredFunction(name, id, func));
@@ -56,6 +66,16 @@ void CLModule::registerFunction(std::string id, CLExternalFunctionPtr func)
 	reg_funcs.push_back(RegisteredFunction("", id, func));
 }
 
+void CLModule::registerFunction(std::string name, std::string id, CLNativeFunctionPtr func)
+{
+	reg_funcs.push_back(RegisteredFunction(name, id, func));
+}
+
+void CLModule::registerFunction(std::string id, CLNativeFunctionPtr func)
+{
+	reg_funcs.push_back(RegisteredFunction("", id, func));
+}
+
 void CLModule::init()
 {
 	// create module namespace table
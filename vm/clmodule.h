@@ -31,6 +31,10 @@ class CLValue;
 
 typedef CLValue (*CLExternalFunctionPtr)(CLThread &thread, std::vector<CLValue> &args, CLValue self);
 
+// Native function ABI: 'args' points to the 'argc' arguments on the thread's stack. They are
+// not copied, so the pointer is only valid during the call.
+typedef CLValue (*CLNativeFunctionPtr)(CLThread &thread, CLValue *args, int argc, CLValue self);
+
 class CLModule
 {
 public:
@@ -40,6 +44,7 @@ public:
 	const std::string &getName() { return this->name; }
 
 	virtual CLExternalFunctionPtr getExternalFunctionPtr(const std::string &ident);
+	virtual CLNativeFunctionPtr getNativeFunctionPtr(const std::string &ident);
 
 	virtual void init();
 	virtual void deinit();
@@ -47,18 +52,22 @@ public:
 protected:
 	void registerFunction(std::string name, std::string id, CLExternalFunctionPtr func); // function with name
 	void registerFunction(std::string id, CLExternalFunctionPtr func); // function without name
+	void registerFunction(std::string name, std::string id, CLNativeFunctionPtr func);
+	void registerFunction(std::string id, CLNativeFunctionPtr func);
 
 private:
 	const std::string name;
 
 	struct RegisteredFunction
 	{
-		RegisteredFunction(std::string name, std::string id, CLExternalFunctionPtr func) : name(name), id(id), func(func) {}
+		RegisteredFunction(std::string name, std::string id, CLExternalFunctionPtr func) : name(name), id(id), func(func), native(0) {}
+		RegisteredFunction(std::string name, std::string id, CLNativeFunctionPtr native) : name(name), id(id), func(0), native(native) {}
 		~RegisteredFunction() {}
 
 		std::string name; // function name visible to application
 		std::string id; // external_function id
-		CLExternalFunctionPtr func; // the function
+		CLExternalFunctionPtr func; // the function (std::vector ABI) ..
+		CLNativeFunctionPtr native; // .. or native function
 	};
 	std::list<RegisteredFunction> reg_funcs;
 };
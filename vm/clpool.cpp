@@ -0,0 +1,46 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "vm/clpool.h"
+
+CLPool::CLPool() : chunk_pos(0), chunk_end(0)
+{
+	for (size_t i=0; i<CL_POOL_MAX_BLOCK / CL_POOL_GRANULARITY; ++i) free_lists[i] = 0;
+}
+
+CLPool::~CLPool()
+{
+	for (size_t i=0; i<chunks.size(); ++i) ::operator delete(chunks[i]);
+}
+
+void *CLPool::allocateFromChunk(size_t block_size)
+{
+	if (chunk_end - chunk_pos < static_cast<ptrdiff_t>(block_size))
+	{
+		// the rest of the current chunk is lost, which is less than the largest block size
+		chunk_pos = static_cast<char*>(::operator new(CL_POOL_CHUNK_SIZE));
+		chunk_end = chunk_pos + CL_POOL_CHUNK_SIZE;
+		chunks.push_back(chunk_pos);
+	}
+
+	void *p = chunk_pos;
+	chunk_pos += block_size;
+	return p;
+}
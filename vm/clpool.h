@@ -0,0 +1,94 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef CL_POOL_H
+#define CL_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+// size classes of the pool, blocks above CL_POOL_MAX_BLOCK bytes are allocated with operator new
+#define CL_POOL_GRANULARITY 16
+#define CL_POOL_MAX_BLOCK   512
+
+// memory chunk size, the blocks are bump allocated from
+#define CL_POOL_CHUNK_SIZE  (64 * 1024)
+
+// Define CL_NO_POOL to allocate all blocks with operator new (e.g. for memory debuggers).
+
+// Size-class memory pool for small VM objects. Blocks are allocated from large chunks, freed blocks
+// are kept in a free list per size class for reuse. The chunks are only released by the destructor.
+class CLPool
+{
+public:
+	CLPool();
+	~CLPool();
+
+	inline void *allocate(size_t size)
+	{
+#ifdef CL_NO_POOL
+		return ::operator new(size);
+#else
+		if (size > CL_POOL_MAX_BLOCK) return ::operator new(size);
+
+		size_t c = sizeClass(size);
+		FreeBlock *block = free_lists[c];
+		if (!block) return allocateFromChunk((c + 1) * CL_POOL_GRANULARITY);
+
+		free_lists[c] = block->next;
+		return block;
+#endif
+	}
+
+	inline void release(void *p, size_t size)
+	{
+#ifdef CL_NO_POOL
+		::operator delete(p);
+#else
+		if (!p) return;
+		if (size > CL_POOL_MAX_BLOCK) { ::operator delete(p); return; }
+
+		size_t c = sizeClass(size);
+		FreeBlock *block = static_cast<FreeBlock*>(p);
+		block->next = free_lists[c];
+		free_lists[c] = block;
+#endif
+	}
+
+	// memory held by the pool
+	size_t chunkBytes() { return chunks.size() * CL_POOL_CHUNK_SIZE; }
+
+private:
+	struct FreeBlock
+	{
+		FreeBlock *next;
+	};
+
+	FreeBlock *free_lists[CL_POOL_MAX_BLOCK / CL_POOL_GRANULARITY];
+
+	char *chunk_pos, *chunk_end; // unused part of current chunk
+	std::vector<char*> chunks;   // all chunks
+
+	static inline size_t sizeClass(size_t size) { return size ? (size - 1) / CL_POOL_GRANULARITY : 0; }
+
+	void *allocateFromChunk(size_t block_size);
+};
+
+#endif
@@ -29,7 +29,7 @@
 
 #include <iostream>
 
-#define DECL_FUNC(name) CLValue name (CLThread &thread, std::vector<CLValue> &args, CLValue self)
+#define DECL_FUNC(name) CLValue name (CLThread &thread, CLValue *args, int argc, CLValue self)
 
 // global functions
 static DECL_FUNC(version);
@@ -40,6 +40,7 @@ static DECL_FUNC(import);
 
 // string member functions
 static DECL_FUNC(string_length);
+static DECL_FUNC(string_clone);
 static DECL_FUNC(string_concat);
 static DECL_FUNC(string_substr);
 static DECL_FUNC(string_replace);
@@ -61,6 +62,7 @@ CLSysModule::CLSysModule() : CLModule("sys")
 
 	// string member functions
 	registerFunction("sys_string_length",                   &string_length);
+	registerFunction("sys_string_clone",                    &string_clone);
 	registerFunction("sys_string_concat",                   &string_concat);
 	registerFunction("sys_string_substr",                   &string_substr);
 	registerFunction("sys_string_replace",                  &string_replace);
@@ -87,8 +89,7 @@ static DECL_FUNC(version)
 
 static DECL_FUNC(print)
 {
-	int i, argc = args.size();
-	for (i=0; i<argc; ++i)
+	for (int i=0; i<argc; ++i)
 	{
 		std::cout << args[i].toString();
 	}
@@ -98,17 +99,18 @@ static DECL_FUNC(print)
 
 static DECL_FUNC(println)
 {
-	print(thread, args, self);
+	print(thread, args, argc, self);
 	std::cout << std::endl;
 	return CLValue::Null();
 }
 
 static DECL_FUNC(startthread) // startthread(func, arg0, ...argN, self)
 {
-	CLValue func = args[0]; args.erase(args.begin());
-	CLValue self_= args[args.size()-1]; args.pop_back();
+	CLValue func = args[0];
+	CLValue self_= args[argc-1];
+	std::vector<CLValue> targs(args + 1, args + argc - 1);
 	CLValue result = CLValue(new CLThread());
-	GET_THREAD(result)->init(func, args, self_);
+	GET_THREAD(result)->init(func, targs, self_);
 	return result;
 }
 
@@ -134,7 +136,7 @@ static DECL_FUNC(import)
 static DECL_FUNC(string_concat) // <str>.concat(<str>) => <str (new)>
 {
 	// check arguments
-	if ((self.type == CL_STRING) && (args.size() > 0) && (args[0].type == CL_STRING))
+	if ((self.type() == CL_STRING) && (argc > 0) && (args[0].type() == CL_STRING))
 	{
 		const std::string &other = GET_STRING(args[0])->get();
 		const std::string &self_ = GET_STRING(self)->get();
@@ -146,7 +148,7 @@ static DECL_FUNC(string_concat) // <str>.concat(<str>) => <str (new)>
 
 static DECL_FUNC(string_length) // <str>.length() => <int>
 {
-	if (self.type == CL_STRING) 
+	if (self.type() == CL_STRING) 
 	{
 		return CLValue(int(GET_STRING(self)->get().length()));
 	} else {
@@ -154,9 +156,19 @@ static DECL_FUNC(string_length) // <str>.length() => <int>
 	}
 }
 
+static DECL_FUNC(string_clone) // <str>.clone() => <str (self, strings are never modified)>
+{
+	if (self.type() == CL_STRING) 
+	{
+		return self;
+	} else {
+		return CLValue::Null();
+	}
+}
+
 static DECL_FUNC(string_substr) // <str>.substr(pos, len) => <str (new)>
 {
-	if ((self.type == CL_STRING) && (args.size() >= 2) && (args[0].type == CL_INTEGER) && (args[1].type == CL_INTEGER))
+	if ((self.type() == CL_STRING) && (argc >= 2) && (args[0].type() == CL_INTEGER) && (args[1].type() == CL_INTEGER))
 	{
 		const std::string &str = GET_STRING(self)->get();
 		size_t pos = GET_INTEGER(args[0]);
@@ -167,17 +179,19 @@ static DECL_FUNC(string_substr) // <str>.substr(pos, len) => <str (new)>
 	}
 }
 
-static DECL_FUNC(string_replace) // <str>.replace(pos, len, <str>) => <str (self)>
+static DECL_FUNC(string_replace) // <str>.replace(pos, len, <str>) => <str (new)>
 {
-	if ((self.type == CL_STRING) && (args.size() >= 3) && 
-            (args[0].type == CL_INTEGER) && (args[1].type == CL_INTEGER) && (args[2].type == CL_STRING))
+	if ((self.type() == CL_STRING) && (argc >= 3) && 
+            (args[0].type() == CL_INTEGER) && (args[1].type() == CL_INTEGER) && (args[2].type() == CL_STRING))
 	{
 		std::string self_str = GET_STRING(self)->get();
 		const std::string &other_str = GET_STRING(args[2])->get();
 		size_t pos = GET_INTEGER(args[0]);
 		size_t len = GET_INTEGER(args[1]);
-		GET_STRING(self)->set(self_str.replace(pos, len, other_str));
-		return self;
+		self_str.replace(pos, len, other_str);
+
+		// strings are never modified, string constants are shared by all executions of their code
+		return CLValue(new CLString(self_str));
 	} else {
 		return CLValue::Null();
 	}
@@ -2,6 +2,7 @@
 #include "vm/clcontext.h"
 #include "vm/clmodule.h"
 #include "vm/clmathmodule.h"
+#include "vm/clverifier.h"
 
 #include "value/clfunction.h"
 #include "value/clexternalfunction.h"
@@ -10,17 +11,23 @@
 #include "value/clarray.h"
 
 #include <assert.h>
+#include <time.h>
 
 #include <algorithm>
 #include <iostream>
+#include <map>
 #include <sstream>
+#include <stdexcept>
 
 using namespace std;
 
 CLThread::CLThread()
-	: do_yield(true), state(CLThread::UNINITIALIZED), result(CLValue::Null()), inside_run_method(0), 
-	  linenum(-1), filename("<input>")
+	: do_yield(true), state(CLThread::UNINITIALIZED), top(0), result(CLValue::Null()), features(0), hook(0), instruction_count(0), 
+	  slice(SLICE_PREEMPTIONS), deadline(0.0), inside_run_method(0)
 {
+	stk.resize(CL_STACK_RESERVE);
+	callstack.reserve(CL_CALLSTACK_RESERVE);
+
 	// register thread in context
 	CLContext::inst().registerThread(CLValue(this));
 }
@@ -36,14 +43,27 @@ CLThread::~CLThread()
 void CLThread::runtimeError(std::string err, bool fatal)
 {
 	if (fatal) {
-		clog << filename << "(" << linenum << "): Fatal runtime error; " << err << endl;
+		clog << getFile() << "(" << getLine() << "): Fatal runtime error; " << err << endl;
 		clog << "=> Killed thread." << endl;
 		kill();
 	} else {
-		clog << filename << "(" << linenum << "): Runtime error; " << err << endl;
+		clog << getFile() << "(" << getLine() << "): Runtime error; " << err << endl;
 	}
 }
 
+int CLThread::getLine()
+{
+	if (callstack.empty()) return -1;
+	CallInfo &ci = callstackTop();
+	return GET_FUNCTION(ci.func)->getLine(ci.ip ? ci.ip - 1 : 0); // ip points behind the current instruction
+}
+
+std::string CLThread::getFile()
+{
+	if (callstack.empty()) return "<input>";
+	return GET_FUNCTION(callstackTop().func)->file;
+}
+
 bool CLThread::isRunning()
 {
 	return state == RUNNING;
@@ -65,9 +85,12 @@ void CLThread::init(CLValue fn, std::vector<CLValue> args, CLValue self)
 	// TODO: Proper error handling
 	assert(state == UNINITIALIZED);
 
+	gc_barrier();
+
 	// fake function call
 
 	// push function & self value
+	stackReserve(top + args.size() + 3);
 	stackPush(fn);
 	stackPush(self.isNull() ? CLContext::inst().getRootTable() : self);
 
@@ -96,8 +119,167 @@ void CLThread::resume()
 	}
 }
 
+// Instruction dispatch
+//
+// The interpreter loop below is written once, in terms of the VM_* macros. With CL_THREADED_DISPATCH
+// every handler ends in its own fetch and indirect jump through 'dispatch_table' (direct threading,
+// using the GCC/Clang labels-as-values extension), otherwise the handlers become the cases of a
+// portable switch statement.
+//
+// The loop is a template over the enabled CL_FEATURE_* flags, run() picks the instantiation. Code
+// for disabled features (preemption, instruction counting, hooks) is compiled out. Source lines are
+// looked up in the function's line table only when needed (runtime errors, line hooks).
+//
+// The loop doesn't test a timeout per instruction. Calls and backward jumps (every loop iteration
+// passes one) are preemption points, which count down 'budget'. When it runs out, sliceExpired()
+// decides if run() returns. Instruction counting also stops after 'steps' instructions (step()).
+
+#define VM_FETCH() \
+	if (COUNT) { if (steps == 0) goto done; --steps; } /* stepped? */ \
+	if (HOOKS && hook && fn->isLineStart(ci->ip)) hook(*this, CL_HOOK_LINE, fn->getLine(ci->ip)); \
+	inst = &(*code)[ci->ip]; /* fetch instruction */ \
+	++(ci->ip); /* increase instruction pointer */
+
+#define VM_PREEMPT() \
+	if (PREEMPT && (0 == --budget) && sliceExpired(budget)) goto done;
+
+// after a call instruction
+#define VM_CALLED() \
+	if (HOOKS && hook) hook(*this, CL_HOOK_CALL, getLine()); \
+	VM_PREEMPT();
+
+// before a return instruction
+#define VM_RETURN() \
+	if (HOOKS && hook) hook(*this, CL_HOOK_RETURN, getLine());
+
+#define VM_JUMP(target) { \
+	unsigned target_ = (target); \
+	bool backward_ = target_ < ci->ip; \
+	ci->ip = target_; \
+	if (backward_) VM_PREEMPT(); \
+}
+
+#ifdef CL_THREADED_DISPATCH
+#	define VM_LOOP_BEGIN()  VM_FETCH(); goto *dispatch_table[inst->op];
+#	define VM_LOOP_END()
+#	define VM_CASE(op)      L_##op:
+#	define VM_NEXT()        { VM_FETCH(); goto *dispatch_table[inst->op]; }
+#else
+#	define VM_LOOP_BEGIN()  for (;;) { VM_FETCH(); switch (inst->op) {
+#	define VM_LOOP_END()    } }
+#	define VM_CASE(op)      case op:
+#	define VM_NEXT()        break
+#endif
+
 void CLThread::run(int timeout)
 {
+	if (timeout == 0) return;
+	slice = SLICE_PREEMPTIONS;
+	execute(features | (timeout < 0 ? 0 : CL_FEATURE_PREEMPT), timeout, ~0UL);
+}
+
+void CLThread::runFor(int usec)
+{
+	slice = SLICE_TIME;
+	deadline = clockSeconds() + usec / 1000000.0;
+	execute(features | CL_FEATURE_PREEMPT, CL_CLOCK_PREEMPTIONS, ~0UL);
+}
+
+void CLThread::step(int count)
+{
+	if (count > 0) execute(features | CL_FEATURE_COUNT, 0, count);
+}
+
+void CLThread::setFeatures(int features)
+{
+	this->features = features & (CL_FEATURE_COUNT | CL_FEATURE_HOOKS);
+}
+
+void CLThread::setHook(CLThreadHook hook)
+{
+	this->hook = hook;
+}
+
+// run the interpreter loop instantiation for 'features'
+void CLThread::execute(int features, int budget, unsigned long steps)
+{
+	// the stack and call frames are changed without further write barriers
+	gc_barrier();
+
+	typedef void (CLThread::*Loop)(int, unsigned long);
+	static const Loop loops[] =
+	{
+		&CLThread::execute<0>, &CLThread::execute<1>, &CLThread::execute<2>, &CLThread::execute<3>,
+		&CLThread::execute<4>, &CLThread::execute<5>, &CLThread::execute<6>, &CLThread::execute<7>,
+	};
+	assert(features >= 0 && features < static_cast<int>(sizeof(loops) / sizeof(loops[0])));
+	(this->*loops[features])(budget, steps);
+}
+
+// monotonic clock (seconds) for time slices
+double CLThread::clockSeconds()
+{
+#ifdef CLOCK_MONOTONIC
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return double(clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+// The preemption budget of execute() ran out: returns true if the time slice is over, otherwise
+// 'budget' is refilled.
+bool CLThread::sliceExpired(int &budget)
+{
+	if (slice == SLICE_PREEMPTIONS) return true;
+	if (clockSeconds() >= deadline) return true;
+	budget = CL_CLOCK_PREEMPTIONS;
+	return false;
+}
+
+template <int FEATURES>
+void CLThread::execute(int budget, unsigned long steps)
+{
+	const bool PREEMPT = (FEATURES & CL_FEATURE_PREEMPT) != 0;
+	const bool COUNT   = (FEATURES & CL_FEATURE_COUNT) != 0;
+	const bool HOOKS   = (FEATURES & CL_FEATURE_HOOKS) != 0;
+	const unsigned long max_steps = steps;
+
+#ifdef CL_THREADED_DISPATCH
+	// handler addresses, in CLOpcode order
+	static void *dispatch_table[] =
+	{
+		&&L_OP_NOP,
+		&&L_OP_PUSH0, &&L_OP_PUSHSELF, &&L_OP_PUSHROOT, &&L_OP_PUSHCONST,
+		&&L_OP_PUSHI, &&L_OP_PUSHF, &&L_OP_POP,
+		&&L_OP_DUP,
+		&&L_OP_NEWTABLE, &&L_OP_NEWARRAY,
+		&&L_OP_TABGET, &&L_OP_TABGET2, &&L_OP_TABSET, &&L_OP_TABIT, &&L_OP_TABNEXT,
+		&&L_OP_CLONE,
+		&&L_OP_GETGLOBAL, &&L_OP_SETGLOBAL,
+		&&L_OP_PUSHL, &&L_OP_POPL, &&L_OP_CLEARL,
+		&&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MODULO, &&L_OP_NEG,
+		&&L_OP_BITOR, &&L_OP_BITAND, &&L_OP_BITXOR, &&L_OP_SHL, &&L_OP_SHR,
+		&&L_OP_AND, &&L_OP_OR, &&L_OP_NOT,
+		&&L_OP_EQ, &&L_OP_NEQ, &&L_OP_LT, &&L_OP_GT, &&L_OP_LE, &&L_OP_GE,
+		&&L_OP_MCALL, &&L_OP_RET, &&L_OP_YIELD, &&L_OP_TAILCALL,
+		&&L_OP_JMP, &&L_OP_JMPT, &&L_OP_JMPF,
+		&&L_OP_EQJMPF, &&L_OP_NEQJMPF, &&L_OP_LTJMPF, &&L_OP_GTJMPF, &&L_OP_LEJMPF, &&L_OP_GEJMPF, &&L_OP_SWITCH,
+		&&L_OP_ADDLK, &&L_OP_LTLKJMPF, &&L_OP_TABPUT,
+		&&L_OP_RMOVE, &&L_OP_RSELF, &&L_OP_RROOT, &&L_OP_RNEWTABLE, &&L_OP_RNEWARRAY,
+		&&L_OP_RTABGET, &&L_OP_RTABGET2, &&L_OP_RTABSET, &&L_OP_RTABIT, &&L_OP_RTABNEXT, &&L_OP_RCLONE,
+		&&L_OP_RGETGLOBAL, &&L_OP_RSETGLOBAL,
+		&&L_OP_RADD, &&L_OP_RSUB, &&L_OP_RMUL, &&L_OP_RDIV, &&L_OP_RMODULO, &&L_OP_RNEG,
+		&&L_OP_RBITOR, &&L_OP_RBITAND, &&L_OP_RBITXOR, &&L_OP_RSHL, &&L_OP_RSHR,
+		&&L_OP_RAND, &&L_OP_ROR, &&L_OP_RNOT,
+		&&L_OP_REQ, &&L_OP_RNEQ, &&L_OP_RLT, &&L_OP_RGT, &&L_OP_RLE, &&L_OP_RGE,
+		&&L_OP_RCALL, &&L_OP_RRET, &&L_OP_RYIELD, &&L_OP_RTAILCALL, &&L_OP_RJMPT, &&L_OP_RJMPF,
+		&&L_OP_REQJMPF, &&L_OP_RNEQJMPF, &&L_OP_RLTJMPF, &&L_OP_RGTJMPF, &&L_OP_RLEJMPF, &&L_OP_RGEJMPF, &&L_OP_RSWITCH,
+	};
+	assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == NUM_OPCODES);
+#endif
+
 	// this function is not reentrant.
 	if (inside_run_method) assert(0); // TODO: Proper handling
 	inside_run_method = true;
@@ -105,6 +287,9 @@ void CLThread::run(int timeout)
 	CallInfo *ci = 0;
 	CLFunction *fn = 0;
 	std::vector<CLInstruction> *code = 0;
+	CLInstruction *inst = 0;
+	CLValue *regs = 0; // register code: the frame's registers
+	CLTable *root = 0; // global variables
 
 	result.setNull();
 
@@ -114,268 +299,595 @@ redo:
 	ci   = &callstackTop();
 	fn   = GET_FUNCTION(ci->func);
 	code = &fn->code;
+	regs = &stk[0] + ci->base; // stk doesn't grow while register code runs
+	root = GET_TABLE(CLContext::inst().getRootTable());
+
+	VM_LOOP_BEGIN()
+		// No operation
+		VM_CASE(OP_NOP) VM_NEXT();
+		
+		// Push constants to stack/pop stack/duplicate stack
+		VM_CASE(OP_PUSH0)       stackPush(CLValue()); VM_NEXT();                                       // push null
+		VM_CASE(OP_PUSHROOT)    stackPush(CLContext::inst().getRootTable()); VM_NEXT();                // push root table
+		VM_CASE(OP_PUSHSELF)    stackPush(ci->self); VM_NEXT();                                        // push self
+		VM_CASE(OP_PUSHCONST)   stackPush(fn->constants[inst->arg]); VM_NEXT();                        // push constant
+		VM_CASE(OP_PUSHI)       stackPush(CLValue(inst->arg)); VM_NEXT();                              // push integer
+		VM_CASE(OP_PUSHF)       stackPush(CLValue(fn->floats[inst->arg])); VM_NEXT();                         // push float	
+
+		VM_CASE(OP_POP) for (int i=0; i<inst->arg; ++i) stackPop(); VM_NEXT();                         // discard <arg> values from stack
+
+		VM_CASE(OP_DUP) stackDup(inst->arg); VM_NEXT();                                                // duplicate value at offset i
+
+		// Local variables
+#define LOCAL(x) stk[ci->base + (x)]
+		VM_CASE(OP_PUSHL) stackPush(LOCAL(inst->arg)); VM_NEXT();                                        // push local variable
+		VM_CASE(OP_POPL) { CLValue v = stackPop(); LOCAL(inst->arg) = v; VM_NEXT(); }                    // pop to local variable
+		VM_CASE(OP_CLEARL)                                                                               // null locals from #arg on
+			for (int i=inst->arg; i<fn->frame_size; ++i) LOCAL(i).setNull();
+			VM_NEXT();
+
+		// Operations. Two integer or two float operands are handled inline, all other combinations
+		// go through the generic CLValue methods. 'T' is the type integers are computed in.
+#define ARITH_FAST_T(dst, x, y, m, oper, T) {\
+	const CLValue &x_ = (x), &y_ = (y);\
+	if (x_.isInteger() && y_.isInteger()) dst = CLValue(T(GET_INTEGER(x_)) oper T(GET_INTEGER(y_)));\
+	else if (x_.isFloat() && y_.isFloat()) dst = CLValue(GET_FLOAT(x_) oper GET_FLOAT(y_));\
+	else dst = CLValue(x_).op##m(y_);\
+}
+#define ARITH_FAST(dst, x, y, m, oper) ARITH_FAST_T(dst, x, y, m, oper, int)
+#define DIV_FAST(dst, x, y, m, oper)   ARITH_FAST_T(dst, x, y, m, oper, double)
 
-	for (;;)
-	{
-		// timeout?
-		if ((timeout != -1) && (0 == timeout--)) goto done;
+#define INTEGER_FAST(dst, x, y, m, oper) {\
+	const CLValue &x_ = (x), &y_ = (y);\
+	if (x_.isInteger() && y_.isInteger()) dst = CLValue(int(GET_INTEGER(x_) oper GET_INTEGER(y_)));\
+	else dst = CLValue(x_).op##m(y_);\
+}
 
-		// fetch instruction
-		CLInstruction *inst = &(*code)[ci->ip];
+#define COMPARE_FAST(dst, x, y, m, oper) {\
+	const CLValue &x_ = (x), &y_ = (y);\
+	if (x_.isInteger() && y_.isInteger()) dst = (GET_INTEGER(x_) oper GET_INTEGER(y_)) ? CLValue::True() : CLValue::False();\
+	else if (x_.isFloat() && y_.isFloat()) dst = (GET_FLOAT(x_) oper GET_FLOAT(y_)) ? CLValue::True() : CLValue::False();\
+	else dst = CLValue(x_).op##m(y_);\
+}
 
-		// increase instruction pointer
-		++(ci->ip);
+// jump unless x 'oper' y
+#define COMPARE_JMPF(x, y, m, oper) {\
+	CLValue c_;\
+	COMPARE_FAST(c_, x, y, m, oper);\
+	if (c_.isFalse()) VM_JUMP(inst->arg);\
+}
 
-		switch (inst->op)
-		{
-			// No operation
-			case OP_NOP: break;
-			
-			// Push constants to stack/pop stack/duplicate stack
-			case OP_PUSH0:       stackPush(CLValue()); break;                                       // push null
-			case OP_PUSHROOT:    stackPush(CLContext::inst().getRootTable()); break;                // push root table
-			case OP_PUSHSELF:    stackPush(ci->self); break;                                        // push self
-			case OP_PUSHCONST:   stackPush(fn->constants[inst->arg]); break;                        // push constant
-			case OP_PUSHEXTFUNC: stackPush(CLValue(new CLExternalFunction(inst->arg_str))); break;  // push external function
-			case OP_PUSHI:       stackPush(CLValue(inst->arg)); break;                              // push integer
-			case OP_PUSHF:       stackPush(CLValue(inst->arg_float)); break;                        // push float	
-			case OP_PUSHS:       stackPush(CLValue(new CLString(inst->arg_str))); break;            // push string
-
-			case OP_POP: for (int i=0; i<inst->arg; ++i) stackPop(); break;                         // discard <arg> values from stack
-
-			case OP_DUP: stackDup(inst->arg); break;                                                // duplicate value at offset i
-
-			// Local variables
-			case OP_PUSHL: stackPush(ci->locals[inst->arg]); break;                                   // push local variable
-			case OP_POPL: ci->locals[inst->arg] = stackPop(); break;                                  // pop to local variable
-			case OP_ADDL: ci->locals.resize(ci->locals.size() + inst->arg, CLValue(12345678)); break; // add n local variables
-			case OP_DELL: ci->locals.erase(ci->locals.end() - inst->arg, ci->locals.end()); break;    // del n local variables
-
-			// Operations
-#define BINARY_OP(m) {\
+// stack code: combine the two topmost values in place
+#define BINARY_OP(FAST, m, oper) {\
+	CLValue &op1 = stk[top-2];\
+	FAST(op1, op1, stackGet(), m, oper);\
+	--top;\
+}
+
+#define BINARY_GENERIC(m) {\
 	CLValue op2 = stackPop();\
-	CLValue op1 = stackPop();\
-	stackPush(op1.op##m(op2));\
+	CLValue &op1 = stackGet();\
+	op1 = op1.op##m(op2);\
 }
 
 #define UNARY_OP(m) {\
-	stackPush(stackPop().op##m());\
+	CLValue &op1 = stackGet();\
+	op1 = op1.op##m();\
 }
 
-			case OP_NEG:    UNARY_OP(_neg);     break; // unary -
+		VM_CASE(OP_NEG)    UNARY_OP(_neg);                        VM_NEXT(); // unary -
+
+		VM_CASE(OP_ADD)    BINARY_OP(ARITH_FAST, _add, +);        VM_NEXT(); // operator +
+		VM_CASE(OP_SUB)    BINARY_OP(ARITH_FAST, _sub, -);        VM_NEXT(); // operator -
+		VM_CASE(OP_MUL)    BINARY_OP(ARITH_FAST, _mul, *);        VM_NEXT(); // operator *
+		VM_CASE(OP_DIV)    BINARY_OP(DIV_FAST, _div, /);          VM_NEXT(); // operator /
+
+		VM_CASE(OP_SHL)    BINARY_OP(INTEGER_FAST, _shl, <<);     VM_NEXT(); // operator <<
+		VM_CASE(OP_SHR)    BINARY_OP(INTEGER_FAST, _shr, >>);     VM_NEXT(); // operator >>
+		VM_CASE(OP_MODULO) BINARY_OP(INTEGER_FAST, _modulo, %);   VM_NEXT(); // operator %
+		VM_CASE(OP_BITOR)  BINARY_OP(INTEGER_FAST, _bitor, |);    VM_NEXT(); // operator |
+		VM_CASE(OP_BITAND) BINARY_OP(INTEGER_FAST, _bitand, &);   VM_NEXT(); // operator & 
+		VM_CASE(OP_BITXOR) BINARY_OP(INTEGER_FAST, _bitxor, ^);   VM_NEXT();
+
+		VM_CASE(OP_AND)    BINARY_GENERIC(_booland);              VM_NEXT(); // boolean and
+		VM_CASE(OP_OR)     BINARY_GENERIC(_boolor);               VM_NEXT(); // boolean or
+		VM_CASE(OP_NOT)    UNARY_OP(_boolnot);                    VM_NEXT(); // boolean not
+
+		VM_CASE(OP_EQ)     BINARY_OP(COMPARE_FAST, _eq, ==);      VM_NEXT(); // ==
+		VM_CASE(OP_NEQ)    BINARY_OP(COMPARE_FAST, _neq, !=);     VM_NEXT(); // !=
+		VM_CASE(OP_LT)     BINARY_OP(COMPARE_FAST, _lt, <);       VM_NEXT(); // <
+		VM_CASE(OP_GT)     BINARY_OP(COMPARE_FAST, _gt, >);       VM_NEXT(); // >
+		VM_CASE(OP_LE)     BINARY_OP(COMPARE_FAST, _le, <=);      VM_NEXT(); // <=
+		VM_CASE(OP_GE)     BINARY_OP(COMPARE_FAST, _ge, >=);      VM_NEXT(); // >=
+#undef UNARY_OP
+#undef BINARY_GENERIC
+#undef BINARY_OP
 
-			case OP_ADD:    BINARY_OP(_add);    break; // operator +
-			case OP_SUB:    BINARY_OP(_sub);    break; // operator -
-			case OP_MUL:    BINARY_OP(_mul);    break; // operator *
-			case OP_DIV:    BINARY_OP(_div);    break; // operator /
+		// Table/Array constructor
+		VM_CASE(OP_NEWTABLE) stackPush(CLValue(new CLTable())); VM_NEXT(); // create new table on stack
+		VM_CASE(OP_NEWARRAY) stackPush(CLValue(new CLArray())); VM_NEXT(); // create new array on stack
 
-			case OP_SHL:    BINARY_OP(_shl);    break; // operator <<
-			case OP_SHR:    BINARY_OP(_shr);    break; // operator >>
-			case OP_MODULO: BINARY_OP(_modulo); break; // operator %
-			case OP_BITOR:  BINARY_OP(_bitor);  break; // operator |
-			case OP_BITAND: BINARY_OP(_bitand); break; // operator & 
-			case OP_BITXOR: BINARY_OP(_bitxor); break;
+		// Get/Set/Iterator operations
+		VM_CASE(OP_TABSET)
+		{ 
+			CLValue v = stackPop(); CLValue k = stackPop(); CLValue t = stackPop();
+			if (t.type() == CL_TABLE)
+			{
+				GET_TABLE(t)->setCached(k, v, fn->getCache(ci->ip-1));
+			} else if (t.isObject()) {
+				t.set(k, v); // GET_OBJECT(t)->set(k, v);
+			} else {
+				runtimeError(std::string("Can't set property '") + k.toString() + "' of non-object '" + t.toString() + "'");
+			}
+			stackPush(v);
+			VM_NEXT();
+		}
 
-			case OP_AND:    BINARY_OP(_booland);break; // boolean and
-			case OP_OR:     BINARY_OP(_boolor); break; // boolean or
-			case OP_NOT:    UNARY_OP (_boolnot);break; // boolean not
+		VM_CASE(OP_TABGET)
+		{
+			CLValue k = stackPop();
+			CLValue t = stackPop();
+			if (t.type() == CL_TABLE)
+			{
+				CLValue v;
+				GET_TABLE(t)->getCached(k, v, fn->getCache(ci->ip-1));
+				stackPush(v);
+			} else if (t.isObject()) {
+				stackPush(t.get(k));
+			} else {
+				runtimeError(std::string("Can't get property '") + k.toString() + "' of non-object '" + t.toString() + "'");
+				stackPush(CLValue::Null());
+			}
+			VM_NEXT();
+		}
 
-			case OP_EQ:     BINARY_OP(_eq);     break; // ==
-			case OP_NEQ:    stackPush(stackPop().op_eq(stackPop()).op_boolnot()); break; // !=
-			case OP_LT:     BINARY_OP(_lt);     break; // <
-			case OP_GT:     BINARY_OP(_gt);     break; // >
-			case OP_LE:     BINARY_OP(_le);     break; // <=
-			case OP_GE:     BINARY_OP(_ge);     break; // >=
-#undef UNARY_OP
-#undef BINARY_OP
+		VM_CASE(OP_TABGET2)
+		{
+			CLValue k = stackPop();
+			CLValue t = stackPop();
 
-			// Table/Array constructor
-			case OP_NEWTABLE: stackPush(CLValue(new CLTable())); break; // create new table on stack
-			case OP_NEWARRAY: stackPush(CLValue(new CLArray())); break; // create new array on stack
-
-			// Get/Set/Iterator operations
-			case OP_TABSET: 
-			{ 
-				CLValue v = stackPop(); CLValue k = stackPop(); CLValue t = stackPop();
-				if (t.type & CL_RAW_ISOBJECT)
-				{
-					t.set(k, v); // GET_OBJECT(t)->set(k, v);
-				} else {
-					runtimeError(std::string("Can't set property '") + k.toString() + "' of non-object '" + t.toString() + "'");
-				}
+			if (t.type() == CL_TABLE)
+			{
+				CLValue v;
+				GET_TABLE(t)->getCached(k, v, fn->getCache(ci->ip-1));
 				stackPush(v);
-				break;
+			} else if (t.isObject()) {
+				stackPush(t.get(k));
+			} else {
+				runtimeError(std::string("Can't get property '") + k.toString() + "' of non-object '" + t.toString() + "'");
+				stackPush(CLValue::Null());
+			}
+
+			stackPush(t);
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_TABIT)
+		{
+			CLValue t = stackPop();
+			stackPush(t);
+			if (t.isObject())
+			{
+				stackPush(GET_OBJECT(t)->begin());
+			} else {
+				runtimeError(std::string("Can't iterate over '") + t.toString() + "'");
+				stackPush(CLValue::Null());
+			}
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_TABNEXT)
+		{
+			CLValue it = stackPop();
+			CLValue t = stackPop();
+			CLValue key, val;
+			if (t.isObject())
+			{
+				it = GET_OBJECT(t)->next(it, key, val);
+			} else {
+				runtimeError(std::string("Can't iterate over '") + t.toString() + "'");
+				it = CLValue::Null();
+			}
+			stackPush(t);
+			stackPush(it);	
+			stackPush(val);
+			stackPush(key);
+			VM_NEXT();
+		}
+
+		// Clone operator
+		VM_CASE(OP_CLONE) stackPush(stackPop().clone()); VM_NEXT();
+
+		// Global variables (the root table's layout id invalidates the inline caches)
+		VM_CASE(OP_GETGLOBAL)
+		{
+			CLValue v;
+			root->getCached(fn->constants[inst->arg], v, fn->getCache(ci->ip-1));
+			stackPush(v);
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_SETGLOBAL)
+		{
+			CLValue v = stackPop();
+			root->setCached(fn->constants[inst->arg], v, fn->getCache(ci->ip-1));
+			VM_NEXT();
+		}
+
+		// Branches
+		VM_CASE(OP_JMP)  VM_JUMP(inst->arg); VM_NEXT();
+		VM_CASE(OP_JMPT) if (stackPop().isTrue()) VM_JUMP(inst->arg); VM_NEXT();
+		VM_CASE(OP_JMPF) if (stackPop().isFalse()) VM_JUMP(inst->arg); VM_NEXT();
+
+#define BINARY_JMPF(m, oper) {\
+	top -= 2; /* before the jump, which may preempt */\
+	COMPARE_JMPF(stk[top], stk[top+1], m, oper);\
+}
+		VM_CASE(OP_EQJMPF)  BINARY_JMPF(_eq, ==);  VM_NEXT();
+		VM_CASE(OP_NEQJMPF) BINARY_JMPF(_neq, !=); VM_NEXT();
+		VM_CASE(OP_LTJMPF)  BINARY_JMPF(_lt, <);   VM_NEXT();
+		VM_CASE(OP_GTJMPF)  BINARY_JMPF(_gt, >);   VM_NEXT();
+		VM_CASE(OP_LEJMPF)  BINARY_JMPF(_le, <=);  VM_NEXT();
+		VM_CASE(OP_GEJMPF)  BINARY_JMPF(_ge, >=);  VM_NEXT();
+#undef BINARY_JMPF
+		VM_CASE(OP_SWITCH) VM_JUMP(fn->switches[inst->arg].lookup(stackGet())); VM_NEXT();
+
+		// Function call/return/yield
+		VM_CASE(OP_MCALL) op_mcall(); VM_CALLED(); goto redo;
+		VM_CASE(OP_RET) VM_RETURN(); op_ret(); goto redo;
+		VM_CASE(OP_YIELD)
+			result = stackPop(); 
+			if (do_yield) goto done;
+			result.setNull();
+			VM_NEXT();
+		VM_CASE(OP_TAILCALL) VM_RETURN(); op_tailcall(); VM_CALLED(); goto redo;
+
+		// Superinstructions
+#define LK(x) ((x) < CL_RK_CONSTANT ? LOCAL(x) : fn->constants[(x) - CL_RK_CONSTANT])
+		VM_CASE(OP_ADDLK)
+			stackPush(LOCAL(inst->a));
+			ARITH_FAST(stackGet(), stackGet(), LK(inst->b), _add, +);
+			VM_NEXT();
+		VM_CASE(OP_LTLKJMPF)  COMPARE_JMPF(LOCAL(inst->a), LK(inst->b), _lt, <); VM_NEXT();
+		VM_CASE(OP_TABPUT)
+		{ 
+			CLValue v = stackPop(); CLValue k = stackPop(); CLValue t = stackPop();
+			if (t.type() == CL_TABLE)
+			{
+				GET_TABLE(t)->setCached(k, v, fn->getCache(ci->ip-1));
+			} else if (t.isObject()) {
+				t.set(k, v);
+			} else {
+				runtimeError(std::string("Can't set property '") + k.toString() + "' of non-object '" + t.toString() + "'");
 			}
+			VM_NEXT();
+		}
+#undef LK
+
+		// Register code
+#define RK(x) ((x) < CL_RK_CONSTANT ? regs[x] : fn->constants[(x) - CL_RK_CONSTANT])
+#define BINARY_OP(FAST, m, oper) FAST(regs[inst->a], RK(inst->b), RK(inst->arg), m, oper)
+#define BINARY_GENERIC(m) regs[inst->a] = RK(inst->b).op##m(RK(inst->arg));
+#define UNARY_OP(m)   regs[inst->a] = RK(inst->b).op##m();
+
+		VM_CASE(OP_RMOVE)     regs[inst->a] = RK(inst->b); VM_NEXT();
+		VM_CASE(OP_RSELF)     regs[inst->a] = ci->self; VM_NEXT();
+		VM_CASE(OP_RROOT)     regs[inst->a] = CLContext::inst().getRootTable(); VM_NEXT();
+		VM_CASE(OP_RNEWTABLE) regs[inst->a] = CLValue(new CLTable()); VM_NEXT();
+		VM_CASE(OP_RNEWARRAY) regs[inst->a] = CLValue(new CLArray()); VM_NEXT();
+
+		VM_CASE(OP_RNEG)    UNARY_OP(_neg);                        VM_NEXT(); // unary -
+
+		VM_CASE(OP_RADD)    BINARY_OP(ARITH_FAST, _add, +);        VM_NEXT(); // operator +
+		VM_CASE(OP_RSUB)    BINARY_OP(ARITH_FAST, _sub, -);        VM_NEXT(); // operator -
+		VM_CASE(OP_RMUL)    BINARY_OP(ARITH_FAST, _mul, *);        VM_NEXT(); // operator *
+		VM_CASE(OP_RDIV)    BINARY_OP(DIV_FAST, _div, /);          VM_NEXT(); // operator /
+
+		VM_CASE(OP_RSHL)    BINARY_OP(INTEGER_FAST, _shl, <<);     VM_NEXT(); // operator <<
+		VM_CASE(OP_RSHR)    BINARY_OP(INTEGER_FAST, _shr, >>);     VM_NEXT(); // operator >>
+		VM_CASE(OP_RMODULO) BINARY_OP(INTEGER_FAST, _modulo, %);   VM_NEXT(); // operator %
+		VM_CASE(OP_RBITOR)  BINARY_OP(INTEGER_FAST, _bitor, |);    VM_NEXT(); // operator |
+		VM_CASE(OP_RBITAND) BINARY_OP(INTEGER_FAST, _bitand, &);   VM_NEXT(); // operator &
+		VM_CASE(OP_RBITXOR) BINARY_OP(INTEGER_FAST, _bitxor, ^);   VM_NEXT();
+
+		VM_CASE(OP_RAND)    BINARY_GENERIC(_booland);              VM_NEXT(); // boolean and
+		VM_CASE(OP_ROR)     BINARY_GENERIC(_boolor);               VM_NEXT(); // boolean or
+		VM_CASE(OP_RNOT)    UNARY_OP(_boolnot);                    VM_NEXT(); // boolean not
+
+		VM_CASE(OP_REQ)     BINARY_OP(COMPARE_FAST, _eq, ==);      VM_NEXT(); // ==
+		VM_CASE(OP_RNEQ)    BINARY_OP(COMPARE_FAST, _neq, !=);     VM_NEXT(); // !=
+		VM_CASE(OP_RLT)     BINARY_OP(COMPARE_FAST, _lt, <);       VM_NEXT(); // <
+		VM_CASE(OP_RGT)     BINARY_OP(COMPARE_FAST, _gt, >);       VM_NEXT(); // >
+		VM_CASE(OP_RLE)     BINARY_OP(COMPARE_FAST, _le, <=);      VM_NEXT(); // <=
+		VM_CASE(OP_RGE)     BINARY_OP(COMPARE_FAST, _ge, >=);      VM_NEXT(); // >=
+#undef UNARY_OP
+#undef BINARY_GENERIC
+#undef BINARY_OP
 
-			case OP_TABGET: 
+		VM_CASE(OP_RTABSET)
+		{
+			CLValue &t = regs[inst->a];
+			if (t.type() == CL_TABLE)
 			{
-				CLValue k = stackPop();
-				CLValue t = stackPop();
-				if (t.type & CL_RAW_ISOBJECT)
-				{
-					stackPush(t.get(k));
-				} else {
-					runtimeError(std::string("Can't get property '") + k.toString() + "' of non-object '" + t.toString() + "'");
-					stackPush(CLValue::Null());
-				}
-				break;
+				GET_TABLE(t)->setCached(RK(inst->b), RK(inst->arg), fn->getCache(ci->ip-1));
+			} else if (t.isObject()) {
+				t.set(RK(inst->b), RK(inst->arg));
+			} else {
+				runtimeError(std::string("Can't set property '") + RK(inst->b).toString() + "' of non-object '" + t.toString() + "'");
 			}
+			VM_NEXT();
+		}
 
-			case OP_TABGET2: 
+		VM_CASE(OP_RTABGET)
+		VM_CASE(OP_RTABGET2)
+		{
+			CLValue t = RK(inst->b);
+			if (t.type() == CL_TABLE)
 			{
-				CLValue k = stackPop();
-				CLValue t = stackPop();
-
-				if (t.type & CL_RAW_ISOBJECT)
-				{
-					stackPush(t.get(k));
-				} else {
-					runtimeError(std::string("Can't get property '") + k.toString() + "' of non-object '" + t.toString() + "'");
-					stackPush(CLValue::Null());
-				}
-
-				stackPush(t);
-				break;
+				CLValue v;
+				GET_TABLE(t)->getCached(RK(inst->arg), v, fn->getCache(ci->ip-1));
+				regs[inst->a] = v;
+			} else if (t.isObject()) {
+				regs[inst->a] = t.get(RK(inst->arg));
+			} else {
+				runtimeError(std::string("Can't get property '") + RK(inst->arg).toString() + "' of non-object '" + t.toString() + "'");
+				regs[inst->a] = CLValue::Null();
 			}
+			if (inst->op == OP_RTABGET2) regs[inst->a+1] = t;
+			VM_NEXT();
+		}
 
-			case OP_TABIT:
+		VM_CASE(OP_RTABIT)
+		{
+			CLValue &t = regs[inst->a];
+			if (t.isObject())
 			{
-				CLValue t = stackPop();
-				stackPush(t);
-				if (t.type & CL_RAW_ISOBJECT)
-				{
-					stackPush(GET_OBJECT(t)->begin());
-				} else {
-					runtimeError(std::string("Can't iterate over '") + t.toString() + "'");
-					stackPush(CLValue::Null());
-				}
-				break;
+				regs[inst->a+1] = GET_OBJECT(t)->begin();
+			} else {
+				runtimeError(std::string("Can't iterate over '") + t.toString() + "'");
+				regs[inst->a+1] = CLValue::Null();
 			}
+			VM_NEXT();
+		}
 
-			case OP_TABNEXT:
+		VM_CASE(OP_RTABNEXT)
+		{
+			CLValue &t = regs[inst->a];
+			CLValue key, val;
+			if (t.isObject())
 			{
-				CLValue it = stackPop();
-				CLValue t = stackPop();
-				CLValue key, val;
-				if (t.type & CL_RAW_ISOBJECT)
-				{
-					it = GET_OBJECT(t)->next(it, key, val);
-				} else {
-					runtimeError(std::string("Can't iterate over '") + t.toString() + "'");
-					it = CLValue::Null();
-				}
-				stackPush(t);
-				stackPush(it);	
-				stackPush(val);
-				stackPush(key);
-				break;
+				regs[inst->a+1] = GET_OBJECT(t)->next(regs[inst->a+1], key, val);
+			} else {
+				runtimeError(std::string("Can't iterate over '") + t.toString() + "'");
+				regs[inst->a+1] = CLValue::Null();
 			}
+			regs[inst->a+2] = val;
+			regs[inst->a+3] = key;
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_RCLONE) regs[inst->a] = RK(inst->b).clone(); VM_NEXT();
 
-			// Clone operator
-			case OP_CLONE: stackPush(stackPop().clone()); break;
-
-			// Branches
-			case OP_JMP:  ci->ip = inst->arg; break;
-			case OP_JMPT: if (stackPop().isTrue()) ci->ip = inst->arg; break;
-			case OP_JMPF: if (stackPop().isFalse()) ci->ip = inst->arg; break;
-
-			// Function call/return/yield
-			case OP_MCALL: op_mcall(); goto redo;
-			case OP_RET: op_ret(); goto redo; 
-			case OP_YIELD: 
-				result = stackPop(); 
-				if (do_yield) goto done;
-				result.setNull();
-				break;
-
-			// Debug info
-			case OP_FILE:
-				this->filename = inst->arg_str;
-				break;
-
-			case OP_LINE:
-				this->linenum = inst->arg;
-				break;
+		VM_CASE(OP_RGETGLOBAL)
+		{
+			CLValue v;
+			root->getCached(fn->constants[inst->arg], v, fn->getCache(ci->ip-1));
+			regs[inst->a] = v;
+			VM_NEXT();
 		}
-	}
+
+		VM_CASE(OP_RSETGLOBAL) root->setCached(fn->constants[inst->arg], RK(inst->b), fn->getCache(ci->ip-1)); VM_NEXT();
+
+		VM_CASE(OP_RJMPT) if (RK(inst->b).isTrue()) VM_JUMP(inst->arg); VM_NEXT();
+		VM_CASE(OP_RJMPF) if (RK(inst->b).isFalse()) VM_JUMP(inst->arg); VM_NEXT();
+
+		VM_CASE(OP_REQJMPF)  COMPARE_JMPF(regs[inst->a], RK(inst->b), _eq, ==);  VM_NEXT();
+		VM_CASE(OP_RNEQJMPF) COMPARE_JMPF(regs[inst->a], RK(inst->b), _neq, !=); VM_NEXT();
+		VM_CASE(OP_RLTJMPF)  COMPARE_JMPF(regs[inst->a], RK(inst->b), _lt, <);   VM_NEXT();
+		VM_CASE(OP_RGTJMPF)  COMPARE_JMPF(regs[inst->a], RK(inst->b), _gt, >);   VM_NEXT();
+		VM_CASE(OP_RLEJMPF)  COMPARE_JMPF(regs[inst->a], RK(inst->b), _le, <=);  VM_NEXT();
+		VM_CASE(OP_RGEJMPF)  COMPARE_JMPF(regs[inst->a], RK(inst->b), _ge, >=);  VM_NEXT();
+		VM_CASE(OP_RSWITCH) VM_JUMP(fn->switches[inst->arg].lookup(RK(inst->b))); VM_NEXT();
+
+		VM_CASE(OP_RCALL) op_rcall(inst->a, inst->arg); VM_CALLED(); goto redo;
+		VM_CASE(OP_RRET) VM_RETURN(); stackPush(RK(inst->b)); op_ret(); goto redo;
+		VM_CASE(OP_RYIELD)
+			result = RK(inst->b);
+			if (do_yield) goto done;
+			result.setNull();
+			VM_NEXT();
+		VM_CASE(OP_RTAILCALL) VM_RETURN(); tailCall(ci->base + inst->a, inst->arg); VM_CALLED(); goto redo;
+#undef RK
+#undef LOCAL
+#undef COMPARE_JMPF
+#undef COMPARE_FAST
+#undef INTEGER_FAST
+#undef DIV_FAST
+#undef ARITH_FAST
+#undef ARITH_FAST_T
+	VM_LOOP_END()
 
 done:
+	if (COUNT) instruction_count += max_steps - steps;
 	inside_run_method = false;
 }
 
+#undef VM_RETURN
+#undef VM_CALLED
+#undef VM_JUMP
+#undef VM_PREEMPT
+#undef VM_NEXT
+#undef VM_CASE
+#undef VM_LOOP_END
+#undef VM_LOOP_BEGIN
+#undef VM_FETCH
+
 void CLThread::kill()
 {
 	result.setNull();
 	callstack.clear(); // empty callstack. !!
-	stk.clear(); // empty stack
+	top = 0; // empty stack
 	state = DONE;
 }
 
-void CLThread::op_mcall()
+// Open a call frame for script function 'func'. Its 'argc' arguments are on top of the stack,
+// starting at index 'args', and become the first local variables of the frame.
+void CLThread::enterFunction(CLValue &func, CLValue &self, unsigned args, int argc, unsigned restore)
 {
-	CLValue func, argc, self;	
-	std::vector<CLValue> args;
-	
-	argc = stackPop(); assert(argc.type == CL_INTEGER); // TODO: Proper error handling
-	args.resize(GET_INTEGER(argc));
-	for (int i=0; i<GET_INTEGER(argc); ++i) args[GET_INTEGER(argc)-i-1] = stackPop();
-	self = stackPop();
-	func = stackPop();
-	
-	//cout << "argc.... : " << GET_INTEGER(argc) << endl;
-	//cout << "func.... : " << GET_STRING(func.toString())->get() << endl;
+	CLFunction *f = GET_FUNCTION(func);
+
+	// throw away arguments or create default null ones, then reserve the remaining locals/registers
+	// and the operand stack
+	unsigned frame = std::max(f->num_args, f->frame_size);
+	stackReserve(args + frame + f->max_stack);
+	if (argc > f->num_args) top = args + f->num_args;
+	stackResize(args + frame);
+
+	callstack.push_back(CallInfo(func, self, args));
+	callstackTop().restore = restore;
+}
 
-	switch (func.type)
+// Call a non-script value with the 'argc' arguments on the stack starting at index 'args'.
+CLValue CLThread::callExternal(CLValue &func, CLValue &self, unsigned args, int argc)
+{
+	if (func.type() == CL_EXTERNALFUNCTION)
 	{
-		case CL_FUNCTION:
-			// throw away arguments or create default null ones
-			args.resize(GET_FUNCTION(func)->num_args, CLValue::Null()); 
-			callstackPush(func, self, args);
-			break;
+		CLExternalFunction *ef = GET_EXTERNALFUNCTION(func);
+
+		// native functions see the arguments in place (stk holds at least func and self below them)
+		CLNativeFunctionPtr native = ef->getNativeFunctionPtr();
+		if (native) return native(*this, &stk[0] + args, argc, self);
 
-		case CL_EXTERNALFUNCTION:
+		// functions registered with the std::vector ABI get a copy
+		CLExternalFunctionPtr fn = ef->getExternalFunctionPtr();
+		if (fn)
 		{
-			CLExternalFunctionPtr fn = GET_EXTERNALFUNCTION(func)->getExternalFunctionPtr();
-			if (fn)
-			{
-				CLValue result = fn(*this, args, self);
-				stackPush(result);
-			} else {
-				runtimeError(std::string("Could not resolve external function '") + func.toString() + "', ignoring call");
-				stackPush(CLValue::Null());
-			}
-			break;
+			std::vector<CLValue> argv(stk.begin() + args, stk.begin() + args + argc);
+			return fn(*this, argv, self);
 		}
+		runtimeError(std::string("Could not resolve external function '") + func.toString() + "', ignoring call");
+	} else {
+		runtimeError(std::string("Ignoring call of uncallable value '") + func.toString() + "'");
+	}
+	return CLValue::Null();
+}
 
-		default:
-			runtimeError(std::string("Ignoring call of uncallable value '") + func.toString() + "'");
-			stackPush(CLValue::Null());
-			break;
+// stack code call: [func self arg1 .. argn argc] -> [result]
+void CLThread::op_mcall()
+{
+	CLValue argc = stackPop(); // verified: pushed by OP_PUSHI
+	unsigned args = top - GET_INTEGER(argc);
+	CLValue func = stk[args-2], self = stk[args-1];
+	
+	if (func.type() == CL_FUNCTION)
+	{
+		// arguments stay in place, func and self are dropped on return
+		enterFunction(func, self, args, GET_INTEGER(argc), args - 2);
+		return;
 	}
+
+	CLValue ret = callExternal(func, self, args, GET_INTEGER(argc));
+	if (state == DONE) return; // killed by external function
+	stk[args-2] = ret; // result replaces func
+	top = args - 1;
+}
+
+// register code call: R[reg] = R[reg](self=R[reg+1], args=R[reg+2..reg+1+argc])
+void CLThread::op_rcall(int reg, int argc)
+{
+	unsigned r = callstackTop().base + reg;
+	CLValue func = stk[r], self = stk[r+1];
+
+	if (func.type() == CL_FUNCTION)
+	{
+		// copy the arguments to a new frame on top of the stack; op_ret delivers the result
+		stackReserve(top + argc);
+		unsigned args = top;
+		for (int i=0; i<argc; ++i) stackPush(CLValue(stk[r+2+i]));
+		callstackTop().ret = reg;
+		enterFunction(func, self, args, argc, args);
+		return;
+	}
+
+	CLValue ret = callExternal(func, self, r + 2, argc);
+	if (state == DONE) return; // killed by external function
+	stk[r] = ret;
+}
+
+// stack code tail call: [func self arg1 .. argn argc] -> return func(arg1 .. argn)
+void CLThread::op_tailcall()
+{
+	CLValue argc = stackPop();
+	tailCall(top - GET_INTEGER(argc) - 2, GET_INTEGER(argc));
+}
+
+// Return the result of calling stk[call] (self: stk[call+1], arguments: the 'argc' values after
+// it). A script function takes over the current call frame, so tail recursion doesn't grow the stacks.
+void CLThread::tailCall(unsigned call, int argc)
+{
+	CLValue func = stk[call], self = stk[call+1];
+	CallInfo &ci = callstackTop();
+
+	if (func.type() != CL_FUNCTION)
+	{
+		CLValue ret = callExternal(func, self, call + 2, argc);
+		if (state == DONE) return; // killed by external function
+		CLFunction *f = GET_FUNCTION(ci.func);
+		top = ci.base + std::max(f->num_args, f->frame_size);
+		stackPush(ret);
+		op_ret();
+		return;
+	}
+
+	// the arguments replace the frame's locals
+	unsigned base = ci.base, restore = ci.restore;
+	for (int i=0; i<argc; ++i) stk[base+i] = stk[call+2+i];
+	top = base + argc;
+	callstackPop();
+	enterFunction(func, self, base, argc, restore);
 }
 
 void CLThread::op_ret()
 {
+	CLValue ret = stackPop();
+	CallInfo &ci = callstackTop();
 #ifdef DEBUG
-	if (!callstackTop().locals.empty())
+	CLFunction *f = GET_FUNCTION(ci.func);
+	if (top != ci.base + std::max(f->num_args, f->frame_size))
 	{
-		cout << "Internal error: Undestroyed locals at function return" << callstack.back().locals.size() << endl;
+		cout << "Internal error: Stack not empty at function return: " << top - ci.base << " items in frame" << endl;
 	}
 #endif
+	top = ci.restore;
 	callstackPop();
 
 	if (callstack.empty()) // thread has finished?
 	{
-		// fetch result from stack
-		result = stackPop();
-#ifdef DEBUG
-		if (!stk.empty())
-		{
-			cout << "Internal error: Stack not empty after function return:" << stk.size() << " items left" << endl;
-		}
-#endif
+		result = ret;
 		state = DONE;
 	}
+	else if (callstackTop().ret != -1)
+	{
+		// caller is register code, move result to its register
+		CallInfo &caller = callstackTop();
+		stk[caller.base + caller.ret] = ret;
+		caller.ret = -1;
+	}
+	else
+	{
+		stackPush(ret);
+	}
+}
+
+void CLThread::stackReserve(unsigned size)
+{
+	if (size > stk.size()) stk.resize(std::max<size_t>(size, 2 * stk.size()));
+}
+
+void CLThread::stackResize(unsigned size)
+{
+	for (unsigned i=top; i<size; ++i) stk[i].setNull();
+	top = size;
 }
 
 // Serialization /////////////////////////////////////////////
@@ -387,7 +899,7 @@ void CLThread::save(CLSerializer &S, CLThread *thread)
 
 	S.IO(tmp = thread->state); 			// ThreadState state
 	CLValue::save(S, thread->result); 		// CLValue result
-	CLValue::saveVector(S, thread->stk);		// std::vector<CLValue> stk;
+	CLValue::saveVector(S, std::vector<CLValue>(thread->stk.begin(), thread->stk.begin() + thread->top)); // stk[0..top-1]
 
 	S.IO(tmp = thread->callstack.size());		// callstack.size()
 	for (size_t i=0; i<thread->callstack.size(); ++i)	// struct CallInfo 
@@ -395,11 +907,10 @@ void CLThread::save(CLSerializer &S, CLThread *thread)
 		S.IO(tmp = thread->callstack[i].ip);
 		CLValue::save(S, thread->callstack[i].func);
 		CLValue::save(S, thread->callstack[i].self);
-		CLValue::saveVector(S, thread->callstack[i].locals);
+		S.IO(tmp = thread->callstack[i].base);
+		S.IO(tmp = thread->callstack[i].restore);
+		int ret = thread->callstack[i].ret; S.IO(ret);
 	}
-
-	S.IO(tmp = thread->linenum);
-	S.IO(thread->filename);
 }
 
 CLThread *CLThread::load(CLSerializer &S)
@@ -410,7 +921,8 @@ CLThread *CLThread::load(CLSerializer &S)
 
 	S.IO(tmp); thread->state = ThreadState(tmp);	// ThreadState state
 	thread->result = CLValue::load(S);		// CLValue result
-	thread->stk = CLValue::loadVector(S);		// std::vector<CLValue> stk
+	thread->stk = CLValue::loadVector(S);		// stk[0..top-1]
+	thread->top = thread->stk.size();
 	
 	S.IO(tmp); thread->callstack.resize(tmp);	// callstack.size()
 	for (size_t i=0; i<thread->callstack.size(); ++i)	// struct CallInfo 
@@ -418,11 +930,54 @@ CLThread *CLThread::load(CLSerializer &S)
 		S.IO(thread->callstack[i].ip);
 		thread->callstack[i].func = CLValue::load(S);
 		thread->callstack[i].self = CLValue::load(S);
-		thread->callstack[i].locals = CLValue::loadVector(S);
+		S.IO(thread->callstack[i].base);
+		S.IO(thread->callstack[i].restore);
+		S.IO(thread->callstack[i].ret);
 	}
 
-	S.IO(thread->linenum);
-	S.IO(thread->filename);
+	// Check the frames against the code of their functions. The operand stack of the top frame has
+	// the depth the verifier computed at its ip, callers are stopped right behind the call which
+	// opened the frame above them, with their operands ending where it restores the stack.
+	// Running and suspended threads have frames, others none.
+	if (thread->state > SUSPENDED) throw std::runtime_error("Invalid thread: bad state");
+	bool active = thread->state == RUNNING || thread->state == SUSPENDED;
+	if (active == thread->callstack.empty()) throw std::runtime_error("Invalid thread: bad state");
+	std::map<CLFunction *, CLVerifier> verifiers;
+	unsigned size = thread->top, end = thread->top;
+	for (size_t i=thread->callstack.size(); i-- > 0;)
+	{
+		CallInfo &ci = thread->callstack[i];
+		if (ci.func.type() != CL_FUNCTION) throw std::runtime_error("Invalid thread: frame without function");
+		CLFunction *f = GET_FUNCTION(ci.func);
+		std::map<CLFunction *, CLVerifier>::iterator v = verifiers.find(f);
+		if (v == verifiers.end())
+		{
+			v = verifiers.insert(std::make_pair(f, CLVerifier(f))).first;
+			if (!v->second.verify()) throw std::runtime_error("Invalid function: " + v->second.getError());
+		}
+
+		int depth = -1;
+		if (i + 1 == thread->callstack.size())
+		{
+			if (ci.ret == -1) depth = v->second.getDepth(ci.ip);
+		}
+		else if (ci.ip > 0 && ci.ip <= f->code.size())
+		{
+			CLInstruction &call = f->code[ci.ip-1];
+			if (call.op == OP_MCALL && ci.ret == -1) depth = v->second.getDepth(ci.ip) - 1; // without the result
+			if (call.op == OP_RCALL && ci.ret == call.a) depth = v->second.getDepth(ci.ip);
+		}
+
+		unsigned frame = std::max(f->num_args, f->frame_size);
+		if (depth < 0 || ci.restore > ci.base || ci.base > end || end - ci.base < frame
+			|| end - ci.base - frame != static_cast<unsigned>(depth))
+		{
+			throw std::runtime_error("Invalid thread: bad frame");
+		}
+		size = std::max(size, ci.base + frame + f->max_stack);
+		end = ci.restore;
+	}
+	thread->stackReserve(size);
 
 	return thread;
 }
@@ -438,13 +993,13 @@ bool CLThread::get(CLValue &key, CLValue &val)
 	const std::string &s = GET_STRING(key)->get();
 
 	if (s == "kill") {
-		val = CLValue(new CLExternalFunction("sys_thread_kill")); return true;
+		val = CLContext::inst().getMethod(CL_METHOD_THREAD_KILL); return true;
 	} else if (s == "isrunning") {
-		val = CLValue(new CLExternalFunction("sys_thread_isrunning")); return true;
+		val = CLContext::inst().getMethod(CL_METHOD_THREAD_ISRUNNING); return true;
 	} else if (s == "suspend") {
-		val = CLValue(new CLExternalFunction("sys_thread_suspend")); return true;
+		val = CLContext::inst().getMethod(CL_METHOD_THREAD_SUSPEND); return true;
 	} else if (s == "resume") {
-		val = CLValue(new CLExternalFunction("sys_thread_resume")); return true;
+		val = CLContext::inst().getMethod(CL_METHOD_THREAD_RESUME); return true;
 	} else if (s == "result") {
 		val = this->result; return true;
 	}
@@ -466,11 +1021,8 @@ CLValue CLThread::next(CLValue iterator, CLValue &key, CLValue &value)
 }
 
 // from CLCollectable ////////////////////////////////////////
-void CLThread::gc_mark()
+int CLThread::gc_traverse()
 {
-	if (gc_isMarked()) return;
-	gc_setMarked();
-
 	// mark result value
 	result.markObject();
 
@@ -481,14 +1033,15 @@ void CLThread::gc_mark()
 		CallInfo &ci = callstack[i];
 		ci.func.markObject();
 		ci.self.markObject();
-		for (size_t x=0; x<ci.locals.size(); ++x) ci.locals[x].markObject();
 	}
 
-	// mark stack
-	for (size_t i=0; i<stk.size(); ++i)
+	// mark stack, including local variables
+	for (size_t i=0; i<top; ++i)
 	{
 		stk[i].markObject();
 	}
+
+	return 1 + cs_size + top;
 }
 
 //////////////////////////////////////////////////////////////
@@ -30,10 +30,35 @@
 
 #include <assert.h>
 
-#ifdef DEBUG
-extern unsigned long icount;
+// Use direct threaded instruction dispatch (labels-as-values) where the compiler supports it.
+// Define CL_NO_THREADED_DISPATCH to force the portable switch based interpreter loop.
+#if defined(__GNUC__) && !defined(CL_NO_THREADED_DISPATCH)
+#define CL_THREADED_DISPATCH
 #endif
 
+// Initial capacity of a thread's value stack and call stack. Both grow on demand, but
+// calls and returns don't allocate until a thread nests deeper than this.
+#define CL_STACK_RESERVE 1024
+#define CL_CALLSTACK_RESERVE 64
+
+// Number of preemption points (calls, backward jumps) between two clock reads of runFor().
+#define CL_CLOCK_PREEMPTIONS 1024
+
+// Optional interpreter features (CLThread::setFeatures). The interpreter loop is compiled once
+// for every combination, disabled features cost nothing.
+#define CL_FEATURE_COUNT   1 // count executed instructions (getInstructionCount())
+#define CL_FEATURE_HOOKS   2 // call the hook function (setHook()) at calls, returns and new lines
+#define CL_FEATURE_PREEMPT 4 // (internal) preempt the thread, set by run(timeout) and runFor()
+
+enum CLHookEvent
+{
+	CL_HOOK_CALL,   // a function was called (the callee's frame is current, unless it's external)
+	CL_HOOK_RETURN, // a function is about to return
+	CL_HOOK_LINE,   // a new source line starts
+};
+
+typedef void (*CLThreadHook)(class CLThread &thread, CLHookEvent event, int line);
+
 class CLThread : public CLObject
 {
 public:
@@ -43,7 +68,20 @@ public:
 	void enableYield(bool yes = false);
 
 	void init(CLValue fn, std::vector<CLValue> = std::vector<CLValue>(), CLValue self = CLValue::Null());
+
+	// Run until the thread yields, finishes or is preempted. The thread is only preempted at calls
+	// and backward jumps: run() after 'timeout' of them (< 0: never), runFor() once the time slice of
+	// 'usec' microseconds is over (checked every CL_CLOCK_PREEMPTIONS preemption points, so a
+	// long running external function can exceed it). step() executes 'count' instructions.
 	void run(int timeout = -1);
+	void runFor(int usec);
+	void step(int count = 1);
+
+	// CL_FEATURE_* flags, default: none
+	void setFeatures(int features);
+	int getFeatures() { return features; }
+	void setHook(CLThreadHook hook);
+	unsigned long getInstructionCount() { return instruction_count; }
 	void kill();
 	void suspend();
 	void resume();
@@ -56,6 +94,10 @@ public:
 
 	void runtimeError(std::string err, bool fatal = false); // display runtime error and kill thread if fatal
 
+	// source position of the current instruction (from the function's line table)
+	int getLine();
+	std::string getFile();
+
 private:
 	bool do_yield;
 
@@ -68,40 +110,67 @@ private:
 	};
 	ThreadState state;
 
+	// Value stack, shared by all call frames. A frame's local variables (including function
+	// arguments; register code: registers) are a window starting at CallInfo::base, the
+	// operand stack of stack code continues above it. stk[0..top-1] are in use. Every call makes
+	// room for the frame and its verified maximum stack depth (CLFunction::max_stack), so the
+	// stack operations don't check for overflow.
 	std::vector<CLValue> stk;
+	unsigned top;
 
-	inline void stackPush(const CLValue &v) { stk.push_back(v); }
-	inline CLValue stackPop()               { CLValue v = *(stk.end()-1); stk.pop_back(); return v; }
-	inline CLValue &stackGet()              { return *(stk.end()-1); }
-	inline void stackDup(int offset)        { stk.push_back(*(stk.rbegin()+offset)); }
+	inline void stackPush(const CLValue &v) { stk[top++] = v; }
+	inline CLValue stackPop()               { return stk[--top]; }
+	inline CLValue &stackGet()              { return stk[top-1]; }
+	inline void stackDup(int offset)        { stk[top] = stk[top-1-offset]; ++top; }
+	void stackReserve(unsigned size);       // make room for 'size' values (invalidates pointers into stk)
+	void stackResize(unsigned size);        // set top, new values are null
 
 	struct CallInfo
 	{
-		CallInfo(CLValue func, CLValue self, std::vector<CLValue> &locals) 
-			: ip(0), func(func), self(self), locals(locals) {}
+		CallInfo(CLValue func, CLValue self, unsigned base) 
+			: ip(0), func(func), self(self), base(base), restore(base), ret(-1) {}
 		CallInfo()
-			: ip(0) {}
-		~CallInfo() {}
+			: ip(0), base(0), restore(0), ret(-1) {}
 
 		unsigned ip;                 // instruction pointer
 		CLValue func;                // current function
 		CLValue self;                // 'self' context
-		std::vector<CLValue> locals; // local variables, including function arguments
+		unsigned base;               // index of the first local variable in stk
+		unsigned restore;            // size of stk to restore on return
+		int ret;                     // register receiving the result of the pending call, -1: stack
 	}; 
 	std::vector<CallInfo> callstack;
 
-	inline void callstackPush(CLValue &fn, CLValue &self, std::vector<CLValue> &locals)
-	{
-		callstack.push_back(CallInfo(fn, self, locals)); 
-	}
 	inline void callstackPop()                            { callstack.pop_back(); }
 	inline CallInfo &callstackTop()                       { return *(callstack.end()-1); }
 
+	void enterFunction(CLValue &func, CLValue &self, unsigned args, int argc, unsigned restore);
+	CLValue callExternal(CLValue &func, CLValue &self, unsigned args, int argc);
 	void op_mcall();
+	void op_rcall(int reg, int argc);
 	void op_ret();
+	void op_tailcall();
+	void tailCall(unsigned call, int argc);
 
 	CLValue result; // yield result or null if RUNNING, return result if DONE
 
+	int features;                    // CL_FEATURE_* flags
+	CLThreadHook hook;
+	unsigned long instruction_count; // CL_FEATURE_COUNT
+
+	enum SliceMode
+	{
+		SLICE_PREEMPTIONS, // run(timeout)
+		SLICE_TIME,        // runFor(usec)
+	};
+	SliceMode slice;
+	double deadline; // SLICE_TIME: end of the time slice (clockSeconds())
+
+	void execute(int features, int budget, unsigned long steps);
+	template <int FEATURES> void execute(int budget, unsigned long steps);
+	bool sliceExpired(int &budget);
+	static double clockSeconds();
+
 	bool inside_run_method; // prevents the run() method from being called recursively
 
 
@@ -123,11 +192,7 @@ private:
 	virtual std::string toString();
 
         // from CLCollectable ////////////////////////////////////////
-	void gc_mark();
-
-	// debug info ////////////////////////////////////////////////
-	int linenum;
-	std::string filename;
+	int gc_traverse();
 
 	//////////////////////////////////////////////////////////////
 
@@ -0,0 +1,299 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "vm/clverifier.h"
+
+#include <algorithm>
+#include <sstream>
+
+CLVerifier::CLVerifier(CLFunction *func_)
+	: func(func_), num_slots(0)
+{
+}
+
+bool CLVerifier::fail(size_t ip, const std::string &msg)
+{
+	std::stringstream ss;
+	ss << "instruction " << ip;
+	if (ip < func->code.size() && func->code[ip].op < NUM_OPCODES) ss << " (" << getOpcodeDesc(CLOpcode(func->code[ip].op)).name << ")";
+	ss << ": " << msg;
+	error = ss.str();
+	return false;
+}
+
+// instructions whose 'arg' is a jump target
+static bool isJump(int op)
+{
+	switch (op)
+	{
+		case OP_JMP: case OP_JMPT: case OP_JMPF:
+		case OP_EQJMPF: case OP_NEQJMPF: case OP_LTJMPF: case OP_GTJMPF: case OP_LEJMPF: case OP_GEJMPF:
+		case OP_LTLKJMPF:
+		case OP_RJMPT: case OP_RJMPF:
+		case OP_REQJMPF: case OP_RNEQJMPF: case OP_RLTJMPF: case OP_RGTJMPF: case OP_RLEJMPF: case OP_RGEJMPF:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// instructions which never continue with the next one
+static bool isTerminal(int op)
+{
+	switch (op)
+	{
+		case OP_JMP: case OP_RET: case OP_TAILCALL: case OP_SWITCH:
+		case OP_RRET: case OP_RTAILCALL: case OP_RSWITCH:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool CLVerifier::checkSwitchTable(size_t ip, int idx)
+{
+	if (idx < 0 || idx >= static_cast<int>(func->switches.size())) return fail(ip, "invalid jump table");
+
+	CLSwitchTable &T = func->switches[idx];
+	if (!isTarget(T.default_target)) return fail(ip, "invalid jump table default target");
+	for (size_t i=0; i<T.targets.size(); ++i)
+	{
+		if (T.targets[i] != -1 && !isTarget(T.targets[i])) return fail(ip, "invalid jump table target");
+	}
+
+	if (T.type == CL_INTEGER) return true;
+	if (T.type != CL_STRING) return fail(ip, "invalid jump table type");
+
+	// lookups probe until an empty bucket
+	size_t size = T.keys.size();
+	if (size == 0 || (size & (size-1)) != 0 || T.targets.size() != size) return fail(ip, "invalid jump table size");
+	if (std::find(T.targets.begin(), T.targets.end(), -1) == T.targets.end()) return fail(ip, "jump table is full");
+	for (size_t i=0; i<size; ++i)
+	{
+		if (T.targets[i] != -1 && T.keys[i].type() != CL_STRING) return fail(ip, "invalid jump table key");
+	}
+	return true;
+}
+
+// check the operands of instruction 'ip', returns its operand stack effect
+bool CLVerifier::checkInstruction(size_t ip, int &pop, int &push)
+{
+	CLInstruction &inst = func->code[ip];
+	pop = 0; push = 0;
+
+	switch (inst.op)
+	{
+		case OP_NOP: case OP_JMP:
+			break;
+
+		case OP_PUSH0: case OP_PUSHSELF: case OP_PUSHROOT: case OP_PUSHI: case OP_NEWTABLE: case OP_NEWARRAY:
+			push = 1; break;
+		case OP_PUSHCONST: case OP_GETGLOBAL:
+			if (!isConstant(inst.arg)) return fail(ip, "invalid constant");
+			push = 1; break;
+		case OP_SETGLOBAL:
+			if (!isConstant(inst.arg)) return fail(ip, "invalid constant");
+			pop = 1; break;
+		case OP_PUSHF:
+			if (inst.arg < 0 || inst.arg >= static_cast<int>(func->floats.size())) return fail(ip, "invalid float");
+			push = 1; break;
+		case OP_POP:
+			if (inst.arg < 0) return fail(ip, "invalid count");
+			pop = inst.arg; break;
+		case OP_DUP:
+			if (inst.arg < 0 || inst.arg >= depth[ip]) return fail(ip, "invalid stack offset");
+			push = 1; break;
+
+		case OP_TABGET: pop = 2; push = 1; break;
+		case OP_TABGET2: pop = 2; push = 2; break;
+		case OP_TABSET: pop = 3; push = 1; break;
+		case OP_TABIT: pop = 1; push = 2; break;
+		case OP_TABNEXT: pop = 2; push = 4; break;
+
+		case OP_PUSHL:
+			if (!isSlot(inst.arg)) return fail(ip, "invalid local");
+			push = 1; break;
+		case OP_POPL:
+			if (!isSlot(inst.arg)) return fail(ip, "invalid local");
+			pop = 1; break;
+		case OP_CLEARL:
+			if (inst.arg < 0) return fail(ip, "invalid local");
+			break;
+
+		case OP_CLONE: case OP_NEG: case OP_NOT:
+			pop = 1; push = 1; break;
+		case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MODULO:
+		case OP_BITOR: case OP_BITAND: case OP_BITXOR: case OP_SHL: case OP_SHR:
+		case OP_AND: case OP_OR:
+		case OP_EQ: case OP_NEQ: case OP_LT: case OP_GT: case OP_LE: case OP_GE:
+			pop = 2; push = 1; break;
+
+		case OP_MCALL: case OP_TAILCALL:
+			// [func self args.. argc], the argument count is pushed right before
+			if (ip == 0 || labels[ip] || func->code[ip-1].op != OP_PUSHI || func->code[ip-1].arg < 0)
+				return fail(ip, "unknown argument count");
+			pop = func->code[ip-1].arg + 3; push = 1; break;
+		case OP_RET: case OP_YIELD: case OP_JMPT: case OP_JMPF:
+			pop = 1; break;
+		case OP_EQJMPF: case OP_NEQJMPF: case OP_LTJMPF: case OP_GTJMPF: case OP_LEJMPF: case OP_GEJMPF:
+			pop = 2; break;
+		case OP_SWITCH: // the value stays on the stack
+			pop = 1; push = 1; break;
+
+		case OP_ADDLK:
+			if (!isSlot(inst.a) || !isRK(inst.b)) return fail(ip, "invalid operand");
+			push = 1; break;
+		case OP_LTLKJMPF:
+			if (!isSlot(inst.a) || !isRK(inst.b)) return fail(ip, "invalid operand");
+			break;
+		case OP_TABPUT: pop = 3; break;
+
+		// register code
+		case OP_RSELF: case OP_RROOT: case OP_RNEWTABLE: case OP_RNEWARRAY:
+			if (!isSlot(inst.a)) return fail(ip, "invalid register");
+			break;
+		case OP_RMOVE: case OP_RNEG: case OP_RNOT: case OP_RCLONE:
+			if (!isSlot(inst.a) || !isRK(inst.b)) return fail(ip, "invalid operand");
+			break;
+		case OP_RTABGET: case OP_RTABSET:
+		case OP_RADD: case OP_RSUB: case OP_RMUL: case OP_RDIV: case OP_RMODULO:
+		case OP_RBITOR: case OP_RBITAND: case OP_RBITXOR: case OP_RSHL: case OP_RSHR:
+		case OP_RAND: case OP_ROR:
+		case OP_REQ: case OP_RNEQ: case OP_RLT: case OP_RGT: case OP_RLE: case OP_RGE:
+			if (!isSlot(inst.a) || !isRK(inst.b) || !isRK(inst.arg)) return fail(ip, "invalid operand");
+			break;
+		case OP_RTABGET2:
+			if (!isSlot(inst.a + 1) || !isRK(inst.b) || !isRK(inst.arg)) return fail(ip, "invalid operand");
+			break;
+		case OP_RTABIT:
+			if (!isSlot(inst.a + 1)) return fail(ip, "invalid register");
+			break;
+		case OP_RTABNEXT:
+			if (!isSlot(inst.a + 3)) return fail(ip, "invalid register");
+			break;
+		case OP_RGETGLOBAL:
+			if (!isSlot(inst.a) || !isConstant(inst.arg)) return fail(ip, "invalid operand");
+			break;
+		case OP_RSETGLOBAL:
+			if (!isRK(inst.b) || !isConstant(inst.arg)) return fail(ip, "invalid operand");
+			break;
+		case OP_RJMPT: case OP_RJMPF: case OP_RYIELD:
+			if (!isRK(inst.b)) return fail(ip, "invalid operand");
+			break;
+		case OP_REQJMPF: case OP_RNEQJMPF: case OP_RLTJMPF: case OP_RGTJMPF: case OP_RLEJMPF: case OP_RGEJMPF:
+			if (!isSlot(inst.a) || !isRK(inst.b)) return fail(ip, "invalid operand");
+			break;
+		case OP_RSWITCH:
+			if (!isRK(inst.b)) return fail(ip, "invalid operand");
+			break;
+		case OP_RCALL: case OP_RTAILCALL: // R[a] function, R[a+1] self, then the arguments
+			if (inst.arg < 0 || !isSlot(inst.a + 1 + inst.arg)) return fail(ip, "invalid register");
+			break;
+		case OP_RRET: // pushes the result for op_ret()
+			if (!isRK(inst.b)) return fail(ip, "invalid operand");
+			push = 1; break;
+
+		default:
+			return fail(ip, "invalid opcode");
+	}
+	return true;
+}
+
+// control flow from an instruction reaches 'target' with stack depth 'd'
+bool CLVerifier::flowTo(size_t ip, int target, int d)
+{
+	if (depth[target] == -1)
+	{
+		depth[target] = d;
+		return true;
+	}
+	if (depth[target] != d) return fail(ip, "stack depth differs at jump target");
+	return true;
+}
+
+bool CLVerifier::verify()
+{
+	size_t n = func->code.size();
+	if (n == 0) return fail(0, "no code");
+	if (func->num_args < 0 || func->frame_size < 0) return fail(0, "invalid frame size");
+	num_slots = std::max(func->num_args, func->frame_size);
+
+	labels.assign(n, false);
+	for (size_t ip=0; ip<n; ++ip)
+	{
+		CLInstruction &inst = func->code[ip];
+		if (inst.op >= NUM_OPCODES) return fail(ip, "invalid opcode");
+		if (isJump(inst.op))
+		{
+			if (!isTarget(inst.arg)) return fail(ip, "invalid jump target");
+			labels[inst.arg] = true;
+		}
+		if (inst.op == OP_SWITCH || inst.op == OP_RSWITCH)
+		{
+			if (!checkSwitchTable(ip, inst.arg)) return false;
+			CLSwitchTable &T = func->switches[inst.arg];
+			labels[T.default_target] = true;
+			for (size_t i=0; i<T.targets.size(); ++i) if (T.targets[i] != -1) labels[T.targets[i]] = true;
+		}
+	}
+
+	// stack depth analysis
+	int max_depth = 0;
+	depth.assign(n, -1);
+	depth[0] = 0;
+	std::vector<size_t> worklist(1, 0);
+	while (!worklist.empty())
+	{
+		size_t ip = worklist.back(); worklist.pop_back();
+		CLInstruction &inst = func->code[ip];
+		int d = depth[ip];
+
+		int pop, push;
+		if (!checkInstruction(ip, pop, push)) return false;
+		if (pop > d) return fail(ip, "stack underflow");
+		int next = d - pop + push;
+		max_depth = std::max(max_depth, next);
+
+		std::vector<int> succ;
+		if (!isTerminal(inst.op))
+		{
+			if (ip + 1 >= n) return fail(ip, "control flow leaves the code");
+			succ.push_back(ip + 1);
+		}
+		if (isJump(inst.op)) succ.push_back(inst.arg);
+		if (inst.op == OP_SWITCH || inst.op == OP_RSWITCH)
+		{
+			CLSwitchTable &T = func->switches[inst.arg];
+			succ.push_back(T.default_target);
+			for (size_t i=0; i<T.targets.size(); ++i) if (T.targets[i] != -1) succ.push_back(T.targets[i]);
+		}
+
+		for (size_t i=0; i<succ.size(); ++i)
+		{
+			bool reached = depth[succ[i]] != -1;
+			if (!flowTo(ip, succ[i], next)) return false;
+			if (!reached) worklist.push_back(succ[i]);
+		}
+	}
+
+	func->max_stack = max_depth;
+	return true;
+}
@@ -0,0 +1,65 @@
+/*
+    This file is part of the CL2 script language interpreter.
+
+    Gunnar Selke <gunnar@gmx.info>
+
+    CL2 is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CL2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CL2; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CLVERIFIER_H
+#define CLVERIFIER_H
+
+#include "value/clfunction.h"
+
+#include <string>
+#include <vector>
+
+// Checks the code of a function before it runs: opcodes, jump targets, switch tables, local/register,
+// constant and side table indices, call argument counts, and that the operand stack neither
+// underflows nor differs in depth where control flow merges. The interpreter relies on this
+// instead of checking at runtime. verify() also sets the function's max_stack, the interpreter
+// preallocates that much stack space above the frame on every call.
+class CLVerifier
+{
+public:
+	CLVerifier(CLFunction *func);
+
+	bool verify();
+	const std::string &getError() { return error; }
+
+	// after verify(): operand stack depth on entry of instruction 'ip', -1: not reachable
+	int getDepth(size_t ip) { return ip < depth.size() ? depth[ip] : -1; }
+
+private:
+	CLFunction *func;
+	int num_slots; // locals/registers of the frame
+	std::string error;
+
+	std::vector<int> depth;   // operand stack depth on entry of each instruction, -1: not reached yet
+	std::vector<bool> labels; // instruction is a jump target
+
+	bool fail(size_t ip, const std::string &msg);
+	bool isSlot(int x) { return x >= 0 && x < num_slots; }
+	bool isConstant(int x) { return x >= 0 && x < static_cast<int>(func->constants.size()); }
+	bool isRK(int x) { return x < CL_RK_CONSTANT ? isSlot(x) : isConstant(x - CL_RK_CONSTANT); }
+	bool isTarget(int x) { return x >= 0 && x < static_cast<int>(func->code.size()); }
+
+	bool checkSwitchTable(size_t ip, int idx);
+	bool checkInstruction(size_t ip, int &pop, int &push);
+	bool flowTo(size_t ip, int target, int d);
+};
+
+#endif